@@ -0,0 +1,351 @@
+/*
+ * Asynchronous operations on AA-Tree.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Queues.
+ *
+ * Submission and completion queues are bounded many-producer
+ * many-consumer rings (Vyukov).  Each cell has a sequence number,
+ * equal to position when cell is free for the producer at that
+ * position and position + 1 when it holds the item for the consumer.
+ * Producers and consumers claim positions with CAS on their own
+ * index, so they meet only when ring is nearly empty or full.
+ *
+ * Submit reserves room in the in-flight count first, poll gives it
+ * back, so neither ring holds more than depth operations.  That does
+ * not make push always succeed: a consumer preempted between taking
+ * its position and freeing the cell keeps that cell busy while others
+ * move on, so a producer wrapping around to it must wait.  Pushes with
+ * reserved room go through queue_push_wait(), which spins until the
+ * cell is freed instead of reporting the ring full.
+ *
+ * Idle worker spins a while, then sleeps on condition variable.
+ * Submitter only takes the mutex when some worker sleeps.
+ */
+
+#include "aaasync.h"
+
+#define ASYNC_LINE 64
+/* operations a worker takes at once */
+#define ASYNC_BATCH 32
+/* spins before sleeping */
+#define ASYNC_SPINS 1000
+
+struct AsyncCell {
+    _Atomic(size_t) seq;
+    struct AAAsyncOp *op;
+};
+
+struct AsyncQueue {
+    _Alignas(ASYNC_LINE) _Atomic(size_t) head;	/* next position to fill */
+    _Alignas(ASYNC_LINE) _Atomic(size_t) tail;	/* next position to take */
+    _Alignas(ASYNC_LINE) struct AsyncCell *cells;
+    size_t mask;
+};
+
+struct AAAsync {
+    struct AsyncQueue sq;		/* submitted */
+    struct AsyncQueue cq;		/* completed */
+    _Alignas(ASYNC_LINE) _Atomic(int) inflight;
+    int depth;
+    struct AATree *tree;
+    _Atomic(int) stop;
+    _Atomic(int) sleepers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int nworkers;
+    pthread_t *workers;
+};
+
+static bool queue_init(struct AsyncQueue *q, size_t size)
+{
+    q->cells = malloc(size * sizeof(struct AsyncCell));
+    if (!q->cells)
+        return false;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return true;
+}
+
+static bool queue_push(struct AsyncQueue *q, struct AAAsyncOp *op)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct AsyncCell *cell;
+    intptr_t dif;
+
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    cell->op = op;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/* room is reserved, cell at head can only be held by a slow consumer */
+static void queue_push_wait(struct AsyncQueue *q, struct AAAsyncOp *op)
+{
+    while (!queue_push(q, op))
+        cpu_relax();
+}
+
+static bool queue_pop(struct AsyncQueue *q, struct AAAsyncOp **op_p)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct AsyncCell *cell;
+    intptr_t dif;
+
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    *op_p = cell->op;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_empty(struct AsyncQueue *q)
+{
+    size_t pos = atomic_load(&q->tail);
+
+    return atomic_load(&q->cells[pos & q->mask].seq) != pos + 1;
+}
+
+/*
+ * Workers
+ */
+
+static void async_exec_one(struct AATree *tree, struct AAAsyncOp *op)
+{
+    switch (op->type) {
+    case AA_ASYNC_SEARCH:
+        op->result = aatree_search(tree, op->value);
+        break;
+    case AA_ASYNC_INSERT:
+        if (tree->flags & AA_TREE_DUPLICATES) {
+            aatree_insert(tree, op->value, op->node);
+            op->result = op->node;
+        } else {
+            op->result = aatree_insert_or_get(tree, op->value, op->node);
+        }
+        break;
+    case AA_ASYNC_REMOVE:
+        op->result = NULL;
+        op->removed = aatree_remove_if(tree, op->value, NULL, NULL);
+        break;
+    }
+}
+
+/* runs of searches go together under one lock, the rest one by one */
+static void async_exec(struct AATree *tree, struct AAAsyncOp **ops, int count)
+{
+    uintptr_t values[ASYNC_BATCH];
+    struct AANode *results[ASYNC_BATCH];
+    int i, j;
+
+    for (i = 0; i < count; i = j) {
+        if (ops[i]->type != AA_ASYNC_SEARCH) {
+            async_exec_one(tree, ops[i]);
+            j = i + 1;
+            continue;
+        }
+
+        for (j = i; j < count && ops[j]->type == AA_ASYNC_SEARCH; j++)
+            values[j - i] = ops[j]->value;
+        aatree_search_batch(tree, values, j - i, results);
+        for (int k = i; k < j; k++)
+            ops[k]->result = results[k - i];
+    }
+}
+
+static void worker_sleep(struct AAAsync *async)
+{
+    pthread_mutex_lock(&async->mutex);
+    atomic_fetch_add(&async->sleepers, 1);
+    /* pairs with fence in async_wake, one of the sides sees the other */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue_empty(&async->sq) && !atomic_load(&async->stop))
+        pthread_cond_wait(&async->cond, &async->mutex);
+    atomic_fetch_sub(&async->sleepers, 1);
+    pthread_mutex_unlock(&async->mutex);
+}
+
+static void *worker_main(void *arg)
+{
+    struct AAAsync *async = arg;
+    struct AAAsyncOp *ops[ASYNC_BATCH];
+    int count, spins = 0;
+
+    while (true) {
+        count = 0;
+        while (count < ASYNC_BATCH && queue_pop(&async->sq, &ops[count]))
+            count++;
+
+        if (count > 0) {
+            async_exec(async->tree, ops, count);
+            for (int i = 0; i < count; i++)
+                queue_push_wait(&async->cq, ops[i]);
+            spins = 0;
+        } else if (atomic_load(&async->stop)) {
+            break;
+        } else if (++spins < ASYNC_SPINS) {
+            cpu_relax();
+        } else {
+            worker_sleep(async);
+            spins = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Callers
+ */
+
+static void async_wake(struct AAAsync *async)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&async->sleepers, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&async->mutex);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+}
+
+int aaasync_submit(struct AAAsync *async, struct AAAsyncOp **ops, int count)
+{
+    int inflight = atomic_load_explicit(&async->inflight, memory_order_relaxed);
+    int n;
+
+    do {
+        n = async->depth - inflight;
+        if (n > count)
+            n = count;
+        if (n <= 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&async->inflight, &inflight, inflight + n));
+
+    for (int i = 0; i < n; i++)
+        queue_push_wait(&async->sq, ops[i]);
+    async_wake(async);
+    return n;
+}
+
+int aaasync_poll(struct AAAsync *async, struct AAAsyncOp **done, int max)
+{
+    int count = 0;
+
+    while (count < max && queue_pop(&async->cq, &done[count]))
+        count++;
+    if (count > 0)
+        atomic_fetch_sub(&async->inflight, count);
+    return count;
+}
+
+/*
+ * Setup
+ */
+
+static void async_stop(struct AAAsync *async, int nstarted)
+{
+    pthread_mutex_lock(&async->mutex);
+    atomic_store(&async->stop, 1);
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+    for (int i = 0; i < nstarted; i++)
+        pthread_join(async->workers[i], NULL);
+}
+
+static void async_free(struct AAAsync *async)
+{
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    free(async->sq.cells);
+    free(async->cq.cells);
+    free(async->workers);
+    free(async);
+}
+
+struct AAAsync *aaasync_create(struct AATree *tree, int nworkers, int depth)
+{
+    struct AAAsync *async;
+    size_t size = 1;
+    int i;
+
+    async = aligned_alloc(ASYNC_LINE, sizeof(*async));
+    if (!async)
+        return NULL;
+
+    while (size < (size_t)depth)
+        size <<= 1;
+    async->sq.cells = async->cq.cells = NULL;
+    async->workers = malloc(nworkers * sizeof(pthread_t));
+    if (!async->workers || !queue_init(&async->sq, size) || !queue_init(&async->cq, size)) {
+        free(async->sq.cells);
+        free(async->workers);
+        free(async);
+        return NULL;
+    }
+
+    atomic_init(&async->inflight, 0);
+    async->depth = depth;
+    async->tree = tree;
+    atomic_init(&async->stop, 0);
+    atomic_init(&async->sleepers, 0);
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    async->nworkers = nworkers;
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&async->workers[i], NULL, worker_main, async) != 0)
+            break;
+    }
+    if (i < nworkers) {
+        async_stop(async, i);
+        async_free(async);
+        return NULL;
+    }
+    return async;
+}
+
+void aaasync_destroy(struct AAAsync *async)
+{
+    async_stop(async, async->nworkers);
+    async_free(async);
+}
@@ -0,0 +1,66 @@
+/*
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ * Asynchronous operations on AA-Tree.
+ *
+ * Caller puts operations into submission queue and later picks them
+ * up from completion queue, neither call waits for the tree lock.
+ * Worker threads take operations in batches and run them on the
+ * tree, searches of a batch go through aatree_search_batch().
+ *
+ * Operations run in no particular order, one that must see the
+ * result of another should be submitted after that one completed.
+ */
+
+#ifndef _USUAL_AAASYNC_H_
+#define _USUAL_AAASYNC_H_
+
+#include "aatree.h"
+
+struct AAAsync;
+
+/** Operation types */
+enum AAAsyncOpType {
+    AA_ASYNC_SEARCH,	/* result is found node or NULL */
+    AA_ASYNC_INSERT,	/* result is node with same value already in tree, or node */
+    AA_ASYNC_REMOVE,	/* removed tells if value was in tree */
+};
+
+/**
+ * Operation, owned by caller until it comes back from aaasync_poll().
+ */
+struct AAAsyncOp {
+    int type;			/* enum AAAsyncOpType */
+    uintptr_t value;
+    struct AANode *node;	/* node to insert */
+    struct AANode *result;	/* set on completion */
+    bool removed;		/* set on completion */
+    void *arg;			/* for caller */
+};
+
+/** Start nworkers threads for tree, at most depth operations in flight */
+struct AAAsync *aaasync_create(struct AATree *tree, int nworkers, int depth);
+
+/** Stop workers after submitted operations are done, unpolled ones are dropped */
+void aaasync_destroy(struct AAAsync *async);
+
+/** Queue operations, returns how many fit, never waits for the tree or a full queue */
+int aaasync_submit(struct AAAsync *async, struct AAAsyncOp **ops, int count);
+
+/** Take up to max completed operations, returns count, never waits */
+int aaasync_poll(struct AAAsync *async, struct AAAsyncOp **done, int max);
+
+#endif
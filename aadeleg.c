@@ -0,0 +1,427 @@
+/*
+ * Delegated AA-Tree.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Rings.
+ *
+ * Every client has one ring per shard, written only by the client
+ * and served only by the shard's server, so ring indexes need no
+ * atomics.  Each slot is one cache line, with request, result and a
+ * sequence word that tells whose turn it is.  For ticket t the slot
+ * sequence is:
+ *
+ *   t         - slot free, client may fill it
+ *   t + 1     - request ready, server may run it
+ *   t + 2     - result ready, client may read it
+ *
+ * After reading the result client sets it to t + RING_SIZE, free for
+ * the ticket that uses the slot next.  Ring size is above 2, so the
+ * values never mix between tickets.
+ *
+ * Server goes over the rings of all clients and runs whatever requests
+ * are ready.  While there are none it spins, then yields, then sleeps
+ * on condition variable of its shard.  Client only takes the mutex to
+ * wake the server when it sleeps.  Client list only grows, released
+ * clients are reused, so server never sees a ring freed under it.
+ */
+
+#include "aadeleg.h"
+
+#include <sched.h>
+
+#define DELEG_LINE 64
+#define DELEG_RING_SIZE 8
+/* spins before yielding */
+#define DELEG_SPINS 100
+/* idle server passes, spins and yields, before sleeping */
+#define DELEG_IDLE_PASSES 1000
+
+enum DelegOp {
+    DELEG_SEARCH,
+    DELEG_INSERT,
+    DELEG_REMOVE,
+};
+
+struct DelegSlot {
+    _Alignas(DELEG_LINE) _Atomic(uint32_t) seq;
+    int op;			/* enum DelegOp */
+    int index;			/* client's own, position in batch */
+    uintptr_t value;
+    struct AANode *node;
+    uintptr_t result;
+};
+
+struct DelegRing {
+    struct DelegSlot slots[DELEG_RING_SIZE];
+    _Alignas(DELEG_LINE) uint32_t head;	/* client: next ticket to submit */
+    uint32_t done;			/* client: next ticket to collect */
+    _Alignas(DELEG_LINE) uint32_t tail;	/* server: next ticket to run */
+};
+
+struct AADelegClient {
+    struct AADelegClient *next;	/* list of all clients, never removed */
+    struct AADeleg *deleg;
+    _Atomic(int) in_use;
+    struct DelegRing rings[FLEX_ARRAY];
+};
+
+struct DelegShard {
+    _Alignas(DELEG_LINE) struct AATree tree;
+    struct AADeleg *deleg;
+    int index;
+    pthread_t thread;
+    _Atomic(int) sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct AADeleg {
+    int nshards;
+    aadeleg_shard_f shard_cb;
+    void *shard_arg;
+    _Atomic(struct AADelegClient *) clients;
+    _Atomic(int) stop;
+    struct DelegShard *shards;
+};
+
+/* spin a while, then let others run */
+static inline void deleg_spin(int *spins)
+{
+    if (++*spins < DELEG_SPINS)
+        cpu_relax();
+    else
+        sched_yield();
+}
+
+/*
+ * Server side
+ */
+
+static uintptr_t deleg_exec(struct AATree *tree, struct DelegSlot *slot)
+{
+    switch (slot->op) {
+    case DELEG_SEARCH:
+        return (uintptr_t)aatree_search(tree, slot->value);
+    case DELEG_INSERT:
+        if (tree->flags & AA_TREE_DUPLICATES) {
+            aatree_insert(tree, slot->value, slot->node);
+            return (uintptr_t)slot->node;
+        }
+        return (uintptr_t)aatree_insert_or_get(tree, slot->value, slot->node);
+    case DELEG_REMOVE:
+        return aatree_remove_if(tree, slot->value, NULL, NULL);
+    }
+    return 0;
+}
+
+/* run ready requests of one ring, false if there were none */
+static bool serve_ring(struct DelegShard *shard, struct DelegRing *ring)
+{
+    struct DelegSlot *slot;
+    bool served = false;
+
+    while (true) {
+        slot = &ring->slots[ring->tail % DELEG_RING_SIZE];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring->tail + 1)
+            return served;
+
+        slot->result = deleg_exec(&shard->tree, slot);
+        atomic_store_explicit(&slot->seq, ring->tail + 2, memory_order_release);
+        ring->tail++;
+        served = true;
+    }
+}
+
+/* is any request for this shard ready */
+static bool shard_pending(struct DelegShard *shard)
+{
+    struct AADelegClient *client = atomic_load_explicit(&shard->deleg->clients, memory_order_acquire);
+    struct DelegRing *ring;
+
+    for (; client; client = client->next) {
+        ring = &client->rings[shard->index];
+        if (atomic_load(&ring->slots[ring->tail % DELEG_RING_SIZE].seq) == ring->tail + 1)
+            return true;
+    }
+    return false;
+}
+
+static void server_sleep(struct DelegShard *shard)
+{
+    pthread_mutex_lock(&shard->mutex);
+    atomic_store(&shard->sleeping, 1);
+    /* pairs with fence in shard_wake, one of the sides sees the other */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!shard_pending(shard) && !atomic_load(&shard->deleg->stop))
+        pthread_cond_wait(&shard->cond, &shard->mutex);
+    atomic_store(&shard->sleeping, 0);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void *server_main(void *arg)
+{
+    struct DelegShard *shard = arg;
+    struct AADeleg *deleg = shard->deleg;
+    struct AADelegClient *client;
+    bool served;
+    int spins = 0, idle = 0;
+
+    while (!atomic_load_explicit(&deleg->stop, memory_order_acquire)) {
+        served = false;
+        client = atomic_load_explicit(&deleg->clients, memory_order_acquire);
+        for (; client; client = client->next)
+            served |= serve_ring(shard, &client->rings[shard->index]);
+
+        if (served) {
+            spins = idle = 0;
+        } else if (++idle < DELEG_IDLE_PASSES) {
+            deleg_spin(&spins);
+        } else {
+            server_sleep(shard);
+            spins = idle = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Client side
+ */
+
+static void shard_wake(struct DelegShard *shard)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&shard->sleeping, memory_order_relaxed))
+        return;
+    pthread_mutex_lock(&shard->mutex);
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/* caller collects before ring is full, so the slot is free */
+static void ring_submit(struct AADelegClient *client, int shard, enum DelegOp op, uintptr_t value,
+                        struct AANode *node, int index)
+{
+    struct DelegRing *ring = &client->rings[shard];
+    uint32_t ticket = ring->head++;
+    struct DelegSlot *slot = &ring->slots[ticket % DELEG_RING_SIZE];
+
+    slot->op = op;
+    slot->index = index;
+    slot->value = value;
+    slot->node = node;
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+    shard_wake(&client->deleg->shards[shard]);
+}
+
+/* wait for result of oldest request */
+static uintptr_t ring_collect(struct DelegRing *ring, int *index_p)
+{
+    uint32_t ticket = ring->done++;
+    struct DelegSlot *slot = &ring->slots[ticket % DELEG_RING_SIZE];
+    uintptr_t result;
+    int spins = 0;
+
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != ticket + 2)
+        deleg_spin(&spins);
+
+    result = slot->result;
+    if (index_p)
+        *index_p = slot->index;
+    atomic_store_explicit(&slot->seq, ticket + DELEG_RING_SIZE, memory_order_release);
+    return result;
+}
+
+static inline int client_shard(struct AADelegClient *client, uintptr_t value)
+{
+    struct AADeleg *deleg = client->deleg;
+    int shard = deleg->shard_cb(value, deleg->shard_arg);
+
+    Assert(shard >= 0 && shard < deleg->nshards);
+    return shard;
+}
+
+static uintptr_t deleg_call(struct AADelegClient *client, enum DelegOp op, uintptr_t value,
+                            struct AANode *node)
+{
+    int shard = client_shard(client, value);
+
+    ring_submit(client, shard, op, value, node, 0);
+    return ring_collect(&client->rings[shard], NULL);
+}
+
+struct AANode *aadeleg_search(struct AADelegClient *client, uintptr_t value)
+{
+    return (struct AANode *)deleg_call(client, DELEG_SEARCH, value, NULL);
+}
+
+struct AANode *aadeleg_insert(struct AADelegClient *client, uintptr_t value, struct AANode *node)
+{
+    return (struct AANode *)deleg_call(client, DELEG_INSERT, value, node);
+}
+
+bool aadeleg_remove(struct AADelegClient *client, uintptr_t value)
+{
+    return deleg_call(client, DELEG_REMOVE, value, NULL) != 0;
+}
+
+/* ring of each shard is kept filled, full ring gives its oldest result first */
+void aadeleg_search_batch(struct AADelegClient *client, const uintptr_t *values, int count,
+                          struct AANode **results)
+{
+    struct DelegRing *ring;
+    uintptr_t result;
+    int index, shard;
+
+    for (int i = 0; i < count; i++) {
+        shard = client_shard(client, values[i]);
+        ring = &client->rings[shard];
+        if (ring->head - ring->done == DELEG_RING_SIZE) {
+            result = ring_collect(ring, &index);
+            results[index] = (struct AANode *)result;
+        }
+        ring_submit(client, shard, DELEG_SEARCH, values[i], NULL, i);
+    }
+
+    for (int s = 0; s < client->deleg->nshards; s++) {
+        ring = &client->rings[s];
+        while (ring->done != ring->head) {
+            result = ring_collect(ring, &index);
+            results[index] = (struct AANode *)result;
+        }
+    }
+}
+
+struct AADelegClient *aadeleg_client(struct AADeleg *deleg)
+{
+    struct AADelegClient *client;
+    size_t size;
+    int expected;
+
+    client = atomic_load(&deleg->clients);
+    for (; client; client = client->next) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&client->in_use, &expected, 1))
+            return client;
+    }
+
+    size = offsetof(struct AADelegClient, rings) + deleg->nshards * sizeof(struct DelegRing);
+    client = aligned_alloc(DELEG_LINE, CUSTOM_ALIGN(size, DELEG_LINE));
+    if (!client)
+        return NULL;
+
+    client->deleg = deleg;
+    atomic_init(&client->in_use, 1);
+    for (int s = 0; s < deleg->nshards; s++) {
+        struct DelegRing *ring = &client->rings[s];
+
+        ring->head = ring->done = ring->tail = 0;
+        for (int i = 0; i < DELEG_RING_SIZE; i++)
+            atomic_init(&ring->slots[i].seq, i);
+    }
+
+    /* servers pick it up on their next pass */
+    client->next = atomic_load(&deleg->clients);
+    while (!atomic_compare_exchange_weak(&deleg->clients, &client->next, client))
+        ;
+    return client;
+}
+
+void aadeleg_client_release(struct AADelegClient *client)
+{
+    atomic_store(&client->in_use, 0);
+}
+
+/*
+ * Setup
+ */
+
+static void deleg_stop(struct AADeleg *deleg, int nstarted)
+{
+    atomic_store(&deleg->stop, 1);
+    for (int s = 0; s < nstarted; s++) {
+        pthread_mutex_lock(&deleg->shards[s].mutex);
+        pthread_cond_signal(&deleg->shards[s].cond);
+        pthread_mutex_unlock(&deleg->shards[s].mutex);
+        pthread_join(deleg->shards[s].thread, NULL);
+    }
+}
+
+struct AADeleg *aadeleg_create(int nshards, aadeleg_shard_f shard_cb, void *shard_arg,
+                               aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags)
+{
+    struct AADeleg *deleg = malloc(sizeof(*deleg));
+    int s;
+
+    if (!deleg)
+        return NULL;
+    deleg->shards = aligned_alloc(DELEG_LINE, nshards * sizeof(struct DelegShard));
+    if (!deleg->shards) {
+        free(deleg);
+        return NULL;
+    }
+
+    deleg->nshards = nshards;
+    deleg->shard_cb = shard_cb;
+    deleg->shard_arg = shard_arg;
+    atomic_init(&deleg->clients, NULL);
+    atomic_init(&deleg->stop, 0);
+
+    /* only the server touches its tree, so it needs no lock and no ordered stores */
+    for (s = 0; s < nshards; s++) {
+        aatree_init_flags(&deleg->shards[s].tree, cmpfn, release_cb, flags | AA_TREE_NO_LOCK);
+        deleg->shards[s].deleg = deleg;
+        deleg->shards[s].index = s;
+        atomic_init(&deleg->shards[s].sleeping, 0);
+        pthread_mutex_init(&deleg->shards[s].mutex, NULL);
+        pthread_cond_init(&deleg->shards[s].cond, NULL);
+    }
+    for (s = 0; s < nshards; s++) {
+        if (pthread_create(&deleg->shards[s].thread, NULL, server_main, &deleg->shards[s]) != 0)
+            break;
+    }
+    if (s < nshards) {
+        deleg_stop(deleg, s);
+        aadeleg_destroy(deleg);
+        return NULL;
+    }
+    return deleg;
+}
+
+void aadeleg_destroy(struct AADeleg *deleg)
+{
+    struct AADelegClient *client, *next;
+
+    if (!atomic_load(&deleg->stop))
+        deleg_stop(deleg, deleg->nshards);
+
+    for (int s = 0; s < deleg->nshards; s++) {
+        aatree_destroy(&deleg->shards[s].tree);
+        pthread_cond_destroy(&deleg->shards[s].cond);
+        pthread_mutex_destroy(&deleg->shards[s].mutex);
+    }
+    for (client = atomic_load(&deleg->clients); client; client = next) {
+        next = client->next;
+        free(client);
+    }
+    free(deleg->shards);
+    free(deleg);
+}
+
+struct AATree *aadeleg_tree(struct AADeleg *deleg, int shard)
+{
+    return &deleg->shards[shard].tree;
+}
@@ -0,0 +1,76 @@
+/*
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ * Delegated AA-Tree.
+ *
+ * Values are split into shards, each shard is a separate tree owned
+ * by one server thread.  Client threads do not touch the trees, they
+ * pass operations to the servers through per-client rings and wait
+ * for the result.  Upper nodes of each tree stay in the cache of its
+ * server, and the trees need no locks.
+ *
+ * Shard trees are AA_TREE_NO_LOCK, which drops the lock, node states
+ * and atomic adds, but node links are still sequentially consistent
+ * atomics, so on x86 every link store is a locked instruction.  Only
+ * build with AATREE_SINGLE_THREADED makes them plain, and that is for
+ * programs where no tree is shared between threads.
+ *
+ * Idle server spins a while, then sleeps until a client submits.
+ *
+ * Each client thread needs its own aadeleg_client().
+ */
+
+#ifndef _USUAL_AADELEG_H_
+#define _USUAL_AADELEG_H_
+
+#include "aatree.h"
+
+struct AADeleg;
+struct AADelegClient;
+
+/** Callback for shard of value, 0 .. nshards - 1 */
+typedef int (*aadeleg_shard_f)(uintptr_t value, void *arg);
+
+/** Start nshards servers, each with empty tree with AATreeFlags */
+struct AADeleg *aadeleg_create(int nshards, aadeleg_shard_f shard_cb, void *shard_arg,
+                               aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags);
+
+/** Stop servers and destroy trees, no client may be in a call */
+void aadeleg_destroy(struct AADeleg *deleg);
+
+/** Client handle for calling thread, NULL on allocation failure */
+struct AADelegClient *aadeleg_client(struct AADeleg *deleg);
+
+/** Give client handle back, it is reused by next aadeleg_client() */
+void aadeleg_client_release(struct AADelegClient *client);
+
+/** Search for node */
+struct AANode *aadeleg_search(struct AADelegClient *client, uintptr_t value);
+
+/** Search for many values, servers work on them in parallel */
+void aadeleg_search_batch(struct AADelegClient *client, const uintptr_t *values, int count,
+                          struct AANode **results);
+
+/** Insert node, returns node with same value that was in tree, or node itself */
+struct AANode *aadeleg_insert(struct AADelegClient *client, uintptr_t value, struct AANode *node);
+
+/** Remove node, returns false if value was not in tree */
+bool aadeleg_remove(struct AADelegClient *client, uintptr_t value);
+
+/** Shard tree, for use while no client is in a call */
+struct AATree *aadeleg_tree(struct AADeleg *deleg, int shard);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Reader-writer lock for AA-Tree.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Lock policies.
+ *
+ * Default pthread rwlock prefers readers, steady stream of them can
+ * keep a writer out for as long as it lasts.  Other policies bound
+ * how long a writer waits:
+ *
+ * writer-preferring - pthread rwlock that lets no new readers in
+ *     while a writer waits.  Readers can starve instead.
+ * phase-fair - PF-T ticket lock (Brandenburg & Anderson 2010).
+ *     Reader and writer phases alternate, reader waits for at most
+ *     one writer and writers are served in order.
+ * task-fair - ticket rwlock, everyone is served in arrival order,
+ *     consecutive readers share their turn.
+ * none - lock and unlock do nothing, for structures that only one
+ *     thread ever touches.
+ *
+ * Fair locks spin for a while and then yield, so lock holder gets
+ * the CPU when there are more threads than cores.
+ *
+ * Reader bias (BRAVO, Dice & Kogan 2019).
+ *
+ * Reader count of pthread rwlock is one cache line that every reader
+ * writes twice.  With bias on, reader instead puts its id into its own
+ * slot, one slot per cache line, and rechecks the bias.  Writer takes
+ * the rwlock, turns bias off and waits until all slots are empty.
+ *
+ * Revocation is slow, so bias stays off for some multiple of the time
+ * last revocation took.  Slow path reader turns it on again after that,
+ * it holds the rwlock for reading so no writer can be in the middle.
+ *
+ * Slots are picked by thread, threads that share a slot go to the
+ * rwlock.  Slot holds the id of owning thread, so unlock knows which
+ * path was taken.  Nested read lock of the slot owner only counts
+ * depth in the slot: going to the rwlock instead would wait behind a
+ * writer that is itself waiting for the slot to empty.
+ */
+
+#include "aalock.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define AALOCK_SLOTS 64
+#define AALOCK_LINE 64
+/* bias stays off for this many revocation times */
+#define AALOCK_INHIBIT_MULT 9
+/* spins before yielding */
+#define AALOCK_SPINS 100
+
+#define AALOCK_POLICIES (AA_LOCK_WRITER_PREF | AA_LOCK_PHASE_FAIR | AA_LOCK_TASK_FAIR | AA_LOCK_NONE)
+
+/* phase-fair rin: reader count above, writer present and phase id below */
+#define PF_RINC 0x100
+#define PF_WBITS 0x3
+#define PF_PRES 0x2
+#define PF_PHID 0x1
+
+struct AALockSlot {
+    _Atomic(void *) owner;
+    int depth;			/* nested read locks, owner only */
+    char pad[AALOCK_LINE - sizeof(void *) - sizeof(int)];
+};
+
+static _Atomic(int) next_slot;
+static _Thread_local int slot_index = -1;
+static _Thread_local char thread_id;
+
+static inline struct AALockSlot *my_slot(struct AALock *lock)
+{
+    if (unlikely(slot_index < 0))
+        slot_index = atomic_fetch_add_explicit(&next_slot, 1, memory_order_relaxed) % AALOCK_SLOTS;
+    return &lock->slots[slot_index];
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* spin a while, then let others run, lock owner may need the CPU */
+static inline void lock_spin(int *spins)
+{
+    if (++*spins < AALOCK_SPINS)
+        cpu_relax();
+    else
+        sched_yield();
+}
+
+static void pf_rdlock(struct AALock *lock)
+{
+    uint32_t w = atomic_fetch_add(&lock->pf.rin, PF_RINC) & PF_WBITS;
+    int spins = 0;
+
+    /* writer is present, wait until its phase is over */
+    while (w != 0 && w == (atomic_load(&lock->pf.rin) & PF_WBITS))
+        lock_spin(&spins);
+}
+
+static bool pf_wrlock(struct AALock *lock)
+{
+    uint32_t ticket = atomic_fetch_add(&lock->pf.win, 1);
+    uint32_t rticket;
+    int spins = 0;
+
+    while (atomic_load(&lock->pf.wout) != ticket)
+        lock_spin(&spins);
+
+    /* block new readers, wait for ones already in */
+    rticket = atomic_fetch_add(&lock->pf.rin, PF_PRES | (ticket & PF_PHID));
+    while (atomic_load(&lock->pf.rout) != rticket)
+        lock_spin(&spins);
+    return spins > 0;
+}
+
+static void pf_wrunlock(struct AALock *lock)
+{
+    atomic_fetch_and(&lock->pf.rin, ~(uint32_t)PF_WBITS);
+    atomic_fetch_add(&lock->pf.wout, 1);
+}
+
+static void tf_rdlock(struct AALock *lock)
+{
+    uint32_t ticket = atomic_fetch_add(&lock->tf.users, 1);
+    int spins = 0;
+
+    while (atomic_load(&lock->tf.read) != ticket)
+        lock_spin(&spins);
+    /* next reader in line may come in too */
+    atomic_fetch_add(&lock->tf.read, 1);
+}
+
+static bool tf_wrlock(struct AALock *lock)
+{
+    uint32_t ticket = atomic_fetch_add(&lock->tf.users, 1);
+    int spins = 0;
+
+    while (atomic_load(&lock->tf.write) != ticket)
+        lock_spin(&spins);
+    return spins > 0;
+}
+
+static void tf_wrunlock(struct AALock *lock)
+{
+    atomic_fetch_add(&lock->tf.read, 1);
+    atomic_fetch_add(&lock->tf.write, 1);
+}
+
+static void base_rdlock(struct AALock *lock)
+{
+    switch (lock->policy) {
+    case AA_LOCK_PHASE_FAIR: pf_rdlock(lock); break;
+    case AA_LOCK_TASK_FAIR: tf_rdlock(lock); break;
+    case AA_LOCK_NONE: break;
+    default: pthread_rwlock_rdlock(&lock->rw_lock); break;
+    }
+}
+
+static void base_rdunlock(struct AALock *lock)
+{
+    switch (lock->policy) {
+    case AA_LOCK_PHASE_FAIR: atomic_fetch_add(&lock->pf.rout, PF_RINC); break;
+    case AA_LOCK_TASK_FAIR: atomic_fetch_add(&lock->tf.write, 1); break;
+    case AA_LOCK_NONE: break;
+    default: pthread_rwlock_unlock(&lock->rw_lock); break;
+    }
+}
+
+/* true if lock was not free */
+static bool base_wrlock(struct AALock *lock)
+{
+    switch (lock->policy) {
+    case AA_LOCK_PHASE_FAIR: return pf_wrlock(lock);
+    case AA_LOCK_TASK_FAIR: return tf_wrlock(lock);
+    case AA_LOCK_NONE: return false;
+    default:
+        if (pthread_rwlock_trywrlock(&lock->rw_lock) == 0)
+            return false;
+        pthread_rwlock_wrlock(&lock->rw_lock);
+        return true;
+    }
+}
+
+static void base_wrunlock(struct AALock *lock)
+{
+    switch (lock->policy) {
+    case AA_LOCK_PHASE_FAIR: pf_wrunlock(lock); break;
+    case AA_LOCK_TASK_FAIR: tf_wrunlock(lock); break;
+    case AA_LOCK_NONE: break;
+    default: pthread_rwlock_unlock(&lock->rw_lock); break;
+    }
+}
+
+static void base_init(struct AALock *lock, int flags)
+{
+    pthread_rwlockattr_t attr;
+
+    /* lowest policy bit wins, except no lock */
+    lock->policy = flags & AALOCK_POLICIES;
+    lock->policy &= -lock->policy;
+    if (flags & AA_LOCK_NONE)
+        lock->policy = AA_LOCK_NONE;
+
+    switch (lock->policy) {
+    case AA_LOCK_PHASE_FAIR:
+        atomic_init(&lock->pf.rin, 0);
+        atomic_init(&lock->pf.rout, 0);
+        atomic_init(&lock->pf.win, 0);
+        atomic_init(&lock->pf.wout, 0);
+        break;
+    case AA_LOCK_TASK_FAIR:
+        atomic_init(&lock->tf.users, 0);
+        atomic_init(&lock->tf.read, 0);
+        atomic_init(&lock->tf.write, 0);
+        break;
+    case AA_LOCK_WRITER_PREF:
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        /* elsewhere there is no portable way, lock stays default */
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&lock->rw_lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        break;
+    case AA_LOCK_NONE:
+        break;
+    default:
+        pthread_rwlock_init(&lock->rw_lock, NULL);
+        break;
+    }
+}
+
+void aalock_init(struct AALock *lock, int flags)
+{
+    lock->slots = NULL;
+    if ((flags & AA_LOCK_BRAVO) && !(flags & AA_LOCK_NONE))
+        lock->slots = aligned_alloc(AALOCK_LINE, AALOCK_SLOTS * sizeof(struct AALockSlot));
+    if (lock->slots) {
+        for (int i = 0; i < AALOCK_SLOTS; i++) {
+            atomic_init(&lock->slots[i].owner, NULL);
+            lock->slots[i].depth = 0;
+        }
+    }
+
+    /* without slots bias is never turned on */
+    atomic_init(&lock->rbias, lock->slots != NULL);
+    atomic_init(&lock->inhibit_until, lock->slots ? 0 : UINT64_MAX);
+    base_init(lock, flags);
+}
+
+void aalock_destroy(struct AALock *lock)
+{
+    if (lock->policy == 0 || lock->policy == AA_LOCK_WRITER_PREF)
+        pthread_rwlock_destroy(&lock->rw_lock);
+    free(lock->slots);
+    lock->slots = NULL;
+}
+
+void aalock_rdlock(struct AALock *lock)
+{
+    struct AALockSlot *slot;
+    void *expected = NULL;
+
+    if (lock->slots) {
+        slot = my_slot(lock);
+        /* already reading through slot, writer is waiting for it */
+        if (atomic_load_explicit(&slot->owner, memory_order_relaxed) == &thread_id) {
+            slot->depth++;
+            return;
+        }
+    }
+
+    if (atomic_load(&lock->rbias)) {
+        slot = my_slot(lock);
+        if (atomic_compare_exchange_strong(&slot->owner, &expected, &thread_id)) {
+            if (likely(atomic_load(&lock->rbias)))
+                return;
+            /* writer got in between */
+            atomic_store(&slot->owner, NULL);
+        }
+    }
+
+    base_rdlock(lock);
+    if (lock->slots && !atomic_load_explicit(&lock->rbias, memory_order_relaxed)
+        && now_ns() >= atomic_load_explicit(&lock->inhibit_until, memory_order_relaxed))
+        atomic_store(&lock->rbias, 1);
+}
+
+void aalock_rdunlock(struct AALock *lock)
+{
+    struct AALockSlot *slot;
+
+    if (lock->slots) {
+        slot = my_slot(lock);
+        if (atomic_load_explicit(&slot->owner, memory_order_relaxed) == &thread_id) {
+            if (slot->depth > 0)
+                slot->depth--;
+            else
+                atomic_store_explicit(&slot->owner, NULL, memory_order_release);
+            return;
+        }
+    }
+    base_rdunlock(lock);
+}
+
+bool aalock_wrlock(struct AALock *lock)
+{
+    uint64_t start, end;
+    int spins = 0;
+    bool waited;
+
+    waited = base_wrlock(lock);
+    if (!atomic_load_explicit(&lock->rbias, memory_order_relaxed))
+        return waited;
+
+    /* revoke bias, wait out the readers that got in with it */
+    start = now_ns();
+    atomic_store(&lock->rbias, 0);
+    for (int i = 0; i < AALOCK_SLOTS; i++) {
+        while (atomic_load(&lock->slots[i].owner) != NULL)
+            lock_spin(&spins);
+    }
+    end = now_ns();
+    atomic_store_explicit(&lock->inhibit_until, end + (end - start) * AALOCK_INHIBIT_MULT,
+                          memory_order_relaxed);
+    return waited || spins > 0;
+}
+
+void aalock_wrunlock(struct AALock *lock)
+{
+    base_wrunlock(lock);
+}
@@ -0,0 +1,93 @@
+/*
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ * Reader-writer lock for AA-Tree.
+ *
+ * Underlying lock is pthread rwlock or one of the fair spinning
+ * locks, picked by policy flag.  Optionally with reader bias: while
+ * bias is on, readers only mark their own cache line in a slot table
+ * and writers scan the table (BRAVO).
+ */
+
+#ifndef _USUAL_AALOCK_H_
+#define _USUAL_AALOCK_H_
+
+#include "base.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct AALockSlot;
+
+/**
+ * Lock flags for aalock_init().
+ */
+enum AALockFlags {
+    AA_LOCK_BRAVO = 1 << 0,	/* readers use per-thread slots while biased */
+
+    /* policy of underlying lock, at most one, default is pthread rwlock */
+    AA_LOCK_WRITER_PREF = 1 << 1,	/* waiting writer blocks new readers */
+    AA_LOCK_PHASE_FAIR = 1 << 2,	/* reader and writer phases alternate */
+    AA_LOCK_TASK_FAIR = 1 << 3,		/* strict arrival order */
+    AA_LOCK_NONE = 1 << 4,		/* no lock at all, one thread uses it */
+};
+
+/**
+ * Lock structure.
+ */
+struct AALock {
+    int policy;				/* AALockFlags policy bit or 0 */
+    _Atomic(int) rbias;			/* readers may take slots */
+    _Atomic(uint64_t) inhibit_until;	/* no bias before this time, ns */
+    struct AALockSlot *slots;		/* reader slots, NULL without bias */
+    union {
+        pthread_rwlock_t rw_lock;	/* default and writer-preferring */
+        struct {
+            _Atomic(uint32_t) rin, rout;	/* reader tickets, writer bits low */
+            _Atomic(uint32_t) win, wout;	/* writer tickets */
+        } pf;				/* phase-fair */
+        struct {
+            _Atomic(uint32_t) users;	/* next ticket */
+            _Atomic(uint32_t) read;	/* ticket that may start reading */
+            _Atomic(uint32_t) write;	/* ticket that may start writing */
+        } tf;				/* task-fair */
+    };
+};
+
+/** Initialize lock with AALockFlags */
+void aalock_init(struct AALock *lock, int flags);
+
+/** Free */
+void aalock_destroy(struct AALock *lock);
+
+/**
+ * Lock for reading.  Thread that already holds the read lock may take
+ * it again with default policy, with or without bias.  Writer-preferring
+ * and fair policies queue the nested lock behind a waiting writer, so
+ * there it may deadlock.
+ */
+void aalock_rdlock(struct AALock *lock);
+
+/** Unlock after aalock_rdlock() */
+void aalock_rdunlock(struct AALock *lock);
+
+/** Lock for writing, returns true if it had to wait for other holders */
+bool aalock_wrlock(struct AALock *lock);
+
+/** Unlock after aalock_wrlock() */
+void aalock_wrunlock(struct AALock *lock);
+
+#endif
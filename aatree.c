@@ -47,6 +47,17 @@
 
 #include <stddef.h>   /* for NULL */
 #include <stdio.h>    /* for printf */
+#include <string.h>   /* for memcmp */
+
+#include <limits.h>   /* for INT_MAX */
+#include <sched.h>    /* for sched_yield */
+#include <time.h>     /* for clock_gettime */
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 typedef struct AATree Tree;
 typedef struct AANode Node;
@@ -59,25 +70,61 @@ static const struct AANode _nil = { NIL, NIL, NIL, 0, Open };
 
 /*
  * Concurrency
+ *
+ * Node state word keeps enum AANodeState in the low bits.  Node held
+ * by operation that others may complete has its descriptor tag above.
+ */
+#define NODE_STATE_MASK 0x3
+#define node_state_of(state) ((state) & NODE_STATE_MASK)
+#define node_tag_of(state) ((state) & ~NODE_STATE_MASK)
+
+/*
+ * Tree with AA_TREE_NO_LOCK is used by one thread at a time, its nodes
+ * need no ordering.  Taking its lock sets node_plain for the thread and
+ * accessors then use relaxed atomics, which are plain loads and stores.
+ * Any unlock clears it, and locking another tree from a callback sets
+ * it for that tree, so other trees keep the ordered path.  Nodes of
+ * other trees must not be read unlocked from callbacks of such tree.
+ * Single-threaded build always takes the plain path.
  */
+#ifdef AATREE_SINGLE_THREADED
+#define node_plain true
+#else
+static _Thread_local bool node_plain;
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/* ordered load is a plain load there already, branch would only cost */
+#define node_load(ptr) atomic_load(ptr)
+#else
+#define node_load(ptr) \
+    (node_plain ? atomic_load_explicit(ptr, memory_order_relaxed) : atomic_load(ptr))
+#endif
+#define node_store(ptr, value) do { \
+    if (node_plain) \
+        atomic_store_explicit(ptr, value, memory_order_relaxed); \
+    else \
+        atomic_store(ptr, value); \
+} while (0)
+
 static void node_atomic_set_left(struct AANode* self, Node* value) {
-    atomic_store_explicit(&self->left, value, memory_order_seq_cst);
+    node_store(&self->left, value);
 }
 
 static void node_atomic_set_right(Node* self, Node* value) {
-    atomic_store_explicit(&self->right, value, memory_order_seq_cst);
+    node_store(&self->right, value);
 }
 
 static void node_atomic_set_parent(Node* self, Node* value) {
-    atomic_store_explicit(&self->parent, value, memory_order_seq_cst);
+    node_store(&self->parent, value);
 }
 
 static void node_atomic_set_level(Node* self, int level) {
-    atomic_store_explicit(&self->level, level, memory_order_seq_cst);
+    node_store(&self->level, level);
 }
 
 static void node_atomic_set_state(Node* self, enum AANodeState state) {
-    atomic_store_explicit(&self->state, state, memory_order_seq_cst);
+    node_store(&self->state, state);
 //    switch (state) {
 //        case Open:
 //            printf("Open\n");
@@ -93,148 +140,613 @@ static void node_atomic_set_state(Node* self, enum AANodeState state) {
 }
 
 static Node* node_atomic_get_left(Node* self) {
-    return atomic_load_explicit(&self->left, memory_order_seq_cst);
+    return node_load(&self->left);
 }
 
 static Node* node_atomic_get_right(Node* self) {
-    return atomic_load_explicit(&self->right, memory_order_seq_cst);
+    return node_load(&self->right);
 }
 
 static Node* node_atomic_get_parent(Node* self) {
-    return atomic_load_explicit(&self->parent, memory_order_seq_cst);
+    return node_load(&self->parent);
 }
 
 static int node_atomic_get_level(Node* self) {
-    return atomic_load_explicit(&self->level, memory_order_seq_cst);
+    return node_load(&self->level);
 }
 
 static int node_atomic_get_state(Node* self) {
-    return atomic_load_explicit(&self->state, memory_order_seq_cst);
+    return node_state_of(node_load(&self->state));
 }
 
 /*
  * Rebalancing.  AA-tree needs only 2 operations
  * to keep the tree balanced.
  */
-static inline bool atomic_rebalancing_state_compare_exchange_weak(Node* node, enum AANodeState state) {
-    enum AANodeState expected_open = Open;
+static inline bool atomic_rebalancing_state_compare_exchange_weak(Node* node, enum AANodeState state_from,
+                                                                 int tag) {
+    int expected = state_from;
+    int expected_open = Open;
 
-    if (atomic_compare_exchange_weak(&node->state, &state, Balancing) ||
-        atomic_compare_exchange_weak(&node->state, &expected_open, Balancing)) {
+    if (atomic_compare_exchange_weak(&node->state, &expected, Balancing | tag) ||
+        atomic_compare_exchange_weak(&node->state, &expected_open, Balancing | tag)) {
         return true;
     }
     return false;
 }
+
 /*
- * X might be participant of rebalancing up to 2 parents.
- * We need to acquire: x, parent, grandparent, children, and grandchildren
- * that will be modified during skew/split operations.
+ * Waiting for busy nodes.
+ *
+ * Nodes are only held under the shared lock, by replace and by insert
+ * that needs no rotation, so only those wait here; rebalancing holds
+ * the exclusive lock and never finds a node busy.
+ *
+ * Failed acquisition is retried after exponentially growing pause.
+ * After that thread sleeps on the state word of the node that was
+ * busy, marking it BalancingWaited so that whoever releases it
+ * knows to wake sleepers.  Sleep has a timeout, node may be freed
+ * and its memory reused while we sleep.
  */
-#define MAX_ACQUIRED_NODES 10
-static inline bool rebalancing_acquire(Node *x, Node *acquired[MAX_ACQUIRED_NODES], enum AANodeState state_from) {
-    Node *x_parent = node_atomic_get_parent(x);
-    Node *x_parent_parent = node_atomic_get_parent(node_atomic_get_parent(x));
-    Node *x_left = node_atomic_get_left(x);
-    Node *x_right = node_atomic_get_right(x);
-    Node *x_left_right = (x_left != NIL) ? node_atomic_get_right(x_left) : NIL;
-    Node *x_right_left = (x_right != NIL) ? node_atomic_get_left(x_right) : NIL;
-    Node *x_right_right = (x_right != NIL) ? node_atomic_get_right(x_right) : NIL;
 
-    for (int i = 0; i < MAX_ACQUIRED_NODES; i++) {
-        acquired[i] = NIL;
-    }
+#define BACKOFF_MAX_SHIFT 10
+#define BACKOFF_PARK_AFTER 16
+#define PARK_TIMEOUT_NS 1000000
 
-    /* Helper function to check if node is already acquired */
-    #define is_already_acquired(node, count) ({ \
-        bool found = false; \
-        for (int j = 0; j < (count); j++) { \
-            if (acquired[j] == (node)) { \
-                found = true; \
-                break; \
-            } \
-        } \
-        found; \
-    })
+static_assert(sizeof(USUAL_AATREE_ATOMIC(int)) == sizeof(int), "futex needs int state");
 
-    int acq_count = 0;
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
 
-    /* Acquire x */
-    if (!atomic_rebalancing_state_compare_exchange_weak(x, state_from)) {
-        return false;
-    }
-    acquired[acq_count++] = x;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    /* Acquire parent */
-    if (x_parent != NIL && !is_already_acquired(x_parent, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_parent, state_from)) {
-            goto release_and_fail;
-        }
-        acquired[acq_count++] = x_parent;
+static inline void tree_stat_add(Tree *tree, enum AATreeStat stat, uint64_t n)
+{
+    uint64_t old;
+
+    if (tree->flags & AA_TREE_NO_LOCK) {
+        old = atomic_load_explicit(&tree->stats[stat], memory_order_relaxed);
+        atomic_store_explicit(&tree->stats[stat], old + n, memory_order_relaxed);
+        return;
     }
+    atomic_fetch_add_explicit(&tree->stats[stat], n, memory_order_relaxed);
+}
+
+/*
+ * Grace period
+ *
+ * Node unlinked under the shared lock may still be looked at by
+ * shared lock holders, of any tree.  Each of them is counted in its
+ * slot, on the side of grace_epoch it saw at its outermost lock.
+ * Waiter flips the epoch and waits until the side it left is empty
+ * in every slot, then does the same for the other side.  Thread that
+ * gets counted only after its slot was checked reads the tree after
+ * the unlink, so it cannot find the node.  Flip before each wait sends
+ * new lock holders to the other side, so they do not hold up the
+ * waiter.  Waiters take grace_lock, one pair of flips at a time.
+ */
+
+#define GRACE_SLOTS 64
+#define GRACE_SPINS 64
 
-    /* Acquire grandparent */
-    if (x_parent_parent != NIL && !is_already_acquired(x_parent_parent, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_parent_parent, state_from)) {
-            goto release_and_fail;
+struct GraceSlot {
+    _Alignas(AATREE_LINE) USUAL_AATREE_ATOMIC(int) readers[2];
+};
+
+static struct GraceSlot grace_slots[GRACE_SLOTS];
+static USUAL_AATREE_ATOMIC(unsigned) grace_epoch;
+static pthread_mutex_t grace_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(int) next_grace_slot;
+static _Thread_local int grace_slot = -1;
+static _Thread_local int grace_depth, grace_side;
+
+static inline void grace_enter(void)
+{
+    if (grace_depth++ > 0)
+        return;
+    if (unlikely(grace_slot < 0))
+        grace_slot = atomic_fetch_add_explicit(&next_grace_slot, 1, memory_order_relaxed)
+            % GRACE_SLOTS;
+    grace_side = atomic_load(&grace_epoch) & 1;
+    atomic_fetch_add(&grace_slots[grace_slot].readers[grace_side], 1);
+}
+
+static inline void grace_leave(void)
+{
+    if (--grace_depth > 0)
+        return;
+    atomic_fetch_sub(&grace_slots[grace_slot].readers[grace_side], 1);
+}
+
+/* wait out everyone who held a shared lock when called; caller must hold none */
+static void grace_wait(void)
+{
+    unsigned side;
+    int spins;
+
+    pthread_mutex_lock(&grace_lock);
+    for (int round = 0; round < 2; round++) {
+        side = atomic_fetch_add(&grace_epoch, 1) & 1;
+        for (int i = 0; i < GRACE_SLOTS; i++) {
+            for (spins = 0; atomic_load(&grace_slots[i].readers[side]) != 0; spins++) {
+                if (spins < GRACE_SPINS)
+                    cpu_relax();
+                else
+                    sched_yield();
+            }
         }
-        acquired[acq_count++] = x_parent_parent;
     }
+    pthread_mutex_unlock(&grace_lock);
+}
+
+/*
+ * Tree lock.  Single-threaded build takes none.  Shared lock holders
+ * of trees with lock are counted for grace periods.
+ */
+static inline void tree_rdlock(Tree *tree)
+{
+#ifndef AATREE_SINGLE_THREADED
+    node_plain = tree->flags & AA_TREE_NO_LOCK;
+    aalock_rdlock(&tree->lock);
+    if (!node_plain)
+        grace_enter();
+#endif
+}
+
+static inline void tree_rdunlock(Tree *tree)
+{
+#ifndef AATREE_SINGLE_THREADED
+    if (!(tree->flags & AA_TREE_NO_LOCK))
+        grace_leave();
+    aalock_rdunlock(&tree->lock);
+    node_plain = false;
+#endif
+}
+
+/* true if lock was busy */
+static inline bool tree_wrlock(Tree *tree)
+{
+#ifndef AATREE_SINGLE_THREADED
+    node_plain = tree->flags & AA_TREE_NO_LOCK;
+    return aalock_wrlock(&tree->lock);
+#else
+    return false;
+#endif
+}
+
+static inline void tree_wrunlock(Tree *tree)
+{
+#ifndef AATREE_SINGLE_THREADED
+    aalock_wrunlock(&tree->lock);
+    node_plain = false;
+#endif
+}
+
+static void state_wait(Node *node, int state)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    struct timespec ts = { 0, PARK_TIMEOUT_NS };
+    syscall(SYS_futex, &node->state, FUTEX_WAIT_PRIVATE, state, &ts, NULL, 0);
+#else
+    sched_yield();
+#endif
+}
+
+static void state_wake(Node *node)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, &node->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* open node acquired with tag, unless someone did it already; wake threads sleeping on it */
+static inline void node_release_state(Node *node, int tag)
+{
+    int state = atomic_load(&node->state);
 
-    /* Acquire left child */
-    if (x_left != NIL && !is_already_acquired(x_left, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_left, state_from)) {
-            goto release_and_fail;
+    while (node_tag_of(state) == tag && node_state_of(state) >= Balancing) {
+        if (atomic_compare_exchange_weak(&node->state, &state, Open)) {
+            if (unlikely(node_state_of(state) == BalancingWaited))
+                state_wake(node);
+            return;
         }
-        acquired[acq_count++] = x_left;
     }
+}
 
-    /* Acquire right child */
-    if (x_right != NIL && !is_already_acquired(x_right, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_right, state_from)) {
-            goto release_and_fail;
-        }
-        acquired[acq_count++] = x_right;
+static void node_park(Tree *tree, Node *node)
+{
+    int state = atomic_load(&node->state);
+    int waited = node_tag_of(state) | BalancingWaited;
+
+    if (node_state_of(state) == Balancing
+        && atomic_compare_exchange_strong(&node->state, &state, waited))
+        state = waited;
+
+    if (state == waited) {
+        tree_stat_add(tree, AA_STAT_PARKS, 1);
+        state_wait(node, waited);
+    } else if (node_state_of(state) != Open) {
+        sched_yield();
     }
+}
+
+/*
+ * Operation descriptors
+ *
+ * Replace runs under the shared lock next to other replaces.  If its
+ * thread is preempted while holding nodes, everyone who needs them
+ * would wait until it runs again.  So once its nodes are held and the
+ * link writes are known, replace publishes them in a descriptor, and
+ * held nodes carry descriptor tag above their state bits.  Thread that
+ * finds such node busy does the writes and releases the nodes itself.
+ *
+ * Writes are compare-and-swap from the old value, doing them twice is
+ * harmless.  Old value does not come back while anyone may still be
+ * helping: it is the replaced node, which is out of the tree, and
+ * replace waits for all shared lock holders before it returns.  For
+ * the same reason the descriptor can live on the owner's stack.
+ *
+ * Rebalancing runs under the exclusive lock and holds no nodes.
+ * Insert under the shared lock holds two nodes for a few stores and
+ * does not wait for readers after, with tag 0 and no descriptor.
+ */
 
-    /* Acquire grandchildren that will be modified in rotations */
-    if (x_left_right != NIL && !is_already_acquired(x_left_right, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_left_right, state_from)) {
-            goto release_and_fail;
+#define DESC_SLOT_BITS 10
+#define DESC_SLOTS (1 << DESC_SLOT_BITS)
+#define DESC_SEQ_MASK ((1 << (31 - 2 - DESC_SLOT_BITS)) - 1)
+#define DESC_SLOT(tag) (((tag) >> 2) & (DESC_SLOTS - 1))
+#define DESC_MAX_WRITES 4
+
+enum DescPhase {
+    DESC_ACQUIRING,	/* owner is taking nodes, wait for it */
+    DESC_APPLYING,	/* writes are known, anyone may do them */
+    DESC_DONE,
+};
+
+struct DescWrite {
+    USUAL_AATREE_ATOMIC(Node *) *addr;
+    Node *old;
+    Node *new;
+};
+
+struct OpDesc {
+    USUAL_AATREE_ATOMIC(int) tag;	/* in state word of held nodes, 0 if no slot */
+    USUAL_AATREE_ATOMIC(int) phase;	/* enum DescPhase */
+    Node **nodes;			/* held nodes, NIL for unused */
+    int nnodes;
+    int nwrites;
+    struct DescWrite writes[DESC_MAX_WRITES];
+};
+
+struct DescSlot {
+    USUAL_AATREE_ATOMIC(struct OpDesc *) desc;
+    uint32_t seq;			/* changed only by thread holding the slot */
+};
+
+static struct DescSlot desc_slots[DESC_SLOTS];
+static USUAL_AATREE_ATOMIC(int) desc_next;
+static _Thread_local int desc_hint = -1;
+
+/* publish descriptor in a free slot, without one it gets tag 0 and nobody helps */
+static void desc_begin(struct OpDesc *d, Node **nodes, int nnodes)
+{
+    struct DescSlot *slot;
+    struct OpDesc *expected;
+
+    atomic_init(&d->tag, 0);
+    atomic_init(&d->phase, DESC_ACQUIRING);
+    d->nodes = nodes;
+    d->nnodes = nnodes;
+    d->nwrites = 0;
+
+    if (unlikely(desc_hint < 0))
+        desc_hint = atomic_fetch_add_explicit(&desc_next, 1, memory_order_relaxed) % DESC_SLOTS;
+    for (int i = 0; i < DESC_SLOTS; i++) {
+        slot = &desc_slots[(desc_hint + i) % DESC_SLOTS];
+        expected = NULL;
+        if (atomic_load_explicit(&slot->desc, memory_order_relaxed) == NULL
+            && atomic_compare_exchange_strong(&slot->desc, &expected, d)) {
+            slot->seq = (slot->seq % DESC_SEQ_MASK) + 1;
+            atomic_store(&d->tag, (int)((slot->seq << DESC_SLOT_BITS | (uint32_t)(slot - desc_slots)) << 2));
+            return;
         }
-        acquired[acq_count++] = x_left_right;
     }
+}
 
-    if (x_right_left != NIL && !is_already_acquired(x_right_left, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_right_left, state_from)) {
-            goto release_and_fail;
-        }
-        acquired[acq_count++] = x_right_left;
+static void desc_end(struct OpDesc *d)
+{
+    int tag = atomic_load_explicit(&d->tag, memory_order_relaxed);
+
+    if (tag != 0)
+        atomic_store(&desc_slots[DESC_SLOT(tag)].desc, NULL);
+}
+
+/* link write, recorded in descriptor if there is one */
+static void desc_write(struct OpDesc *d, USUAL_AATREE_ATOMIC(Node *) *addr, Node *old, Node *new)
+{
+    if (!d) {
+        atomic_store(addr, new);
+        return;
     }
+    Assert(d->nwrites < DESC_MAX_WRITES);
+    d->writes[d->nwrites++] = (struct DescWrite){ addr, old, new };
+}
 
-    if (x_right_right != NIL && !is_already_acquired(x_right_right, acq_count)) {
-        if (!atomic_rebalancing_state_compare_exchange_weak(x_right_right, state_from)) {
-            goto release_and_fail;
-        }
-        acquired[acq_count++] = x_right_right;
+/* do the writes and release the nodes, by owner or helper */
+static void desc_complete(struct OpDesc *d)
+{
+    int tag = atomic_load_explicit(&d->tag, memory_order_relaxed);
+    Node *expected;
+
+    for (int i = 0; i < d->nwrites; i++) {
+        expected = d->writes[i].old;
+        atomic_compare_exchange_strong(d->writes[i].addr, &expected, d->writes[i].new);
     }
+    for (int i = 0; i < d->nnodes; i++) {
+        if (d->nodes[i] != NIL)
+            node_release_state(d->nodes[i], tag);
+    }
+    atomic_store(&d->phase, DESC_DONE);
+}
+
+/* writes are all recorded, let others see them and do them */
+static void desc_run(struct OpDesc *d)
+{
+    atomic_store(&d->phase, DESC_APPLYING);
+    desc_complete(d);
+}
+
+/* complete operation holding node with this state, false if it cannot be done */
+static bool desc_help(Tree *tree, int state)
+{
+    int tag = node_tag_of(state);
+    struct OpDesc *d;
+
+    if (tag == 0)
+        return false;
+    d = atomic_load(&desc_slots[DESC_SLOT(tag)].desc);
+    if (!d || atomic_load_explicit(&d->tag, memory_order_relaxed) != tag
+        || atomic_load(&d->phase) != DESC_APPLYING)
+        return false;
 
-    #undef is_already_acquired
+    desc_complete(d);
+    tree_stat_add(tree, AA_STAT_HELPS, 1);
     return true;
+}
 
-    release_and_fail:
-    for (int i = 0; i < MAX_ACQUIRED_NODES; i++) {
-        if (acquired[i] != NIL) {
-            node_atomic_set_state(acquired[i], Open);
+/*
+ * Node count
+ *
+ * Each thread adds to its own share of the count, picked like lock
+ * slots, so inserts of different threads do not meet on one cache
+ * line.  Share that grows past COUNT_FOLD either way is moved into
+ * tree->count, which then is the approximate count.  Exact count
+ * sums tree->count and the shares.  Folding subtracts from share as
+ * much as it adds to the base, so the sum holds even when threads
+ * sharing a slot fold at once.
+ */
+
+#define COUNT_FOLD 64
+
+static _Atomic(int) next_count_shard;
+static _Thread_local int count_shard = -1;
+
+static void tree_count_add(Tree *tree, int n)
+{
+    struct AATreeCountShard *shard;
+    int delta;
+
+    /* one thread, no need for atomic add */
+    if (tree->flags & AA_TREE_NO_LOCK) {
+        delta = atomic_load_explicit(&tree->count, memory_order_relaxed);
+        atomic_store_explicit(&tree->count, delta + n, memory_order_relaxed);
+        return;
+    }
+
+    if (unlikely(count_shard < 0))
+        count_shard = atomic_fetch_add_explicit(&next_count_shard, 1, memory_order_relaxed)
+            % AATREE_COUNT_SHARDS;
+    shard = &tree->count_shards[count_shard];
+
+    delta = atomic_fetch_add_explicit(&shard->delta, n, memory_order_relaxed) + n;
+    if (delta >= COUNT_FOLD || delta <= -COUNT_FOLD) {
+        atomic_fetch_sub_explicit(&shard->delta, delta, memory_order_relaxed);
+        atomic_fetch_add_explicit(&tree->count, delta, memory_order_relaxed);
+    }
+}
+
+static void tree_count_reset(Tree *tree)
+{
+    atomic_store_explicit(&tree->count, 0, memory_order_relaxed);
+    for (int i = 0; i < AATREE_COUNT_SHARDS; i++)
+        atomic_store_explicit(&tree->count_shards[i].delta, 0, memory_order_relaxed);
+}
+
+int aatree_count(Tree *tree)
+{
+    int count = atomic_load(&tree->count);
+
+    for (int i = 0; i < AATREE_COUNT_SHARDS; i++)
+        count += atomic_load_explicit(&tree->count_shards[i].delta, memory_order_relaxed);
+    return count;
+}
+
+int aatree_count_approx(Tree *tree)
+{
+    return atomic_load_explicit(&tree->count, memory_order_relaxed);
+}
+
+/*
+ * Adaptive locking
+ *
+ * With AA_TREE_ADAPTIVE tree starts in coarse mode: every change is
+ * done under the exclusive lock, which holds no node states, and that
+ * is cheapest while one thread writes.  Exclusive lock holder counts
+ * its operations, and how many found the lock busy or lost a node to
+ * another thread.  Every ADAPT_WINDOW operations the rate picks the
+ * mode: contended one in ADAPT_FINE_DIV or more goes fine-grained,
+ * where inserts that need no rotation and replaces run under the
+ * shared lock; less than one in ADAPT_COARSE_DIV goes back.
+ *
+ * Mode changes only under the exclusive lock and coarse operations
+ * run under it entirely, so it never changes under an operation.
+ * Shared side only reads it to pick a path.
+ */
+
+#define ADAPT_WINDOW 256
+#define ADAPT_FINE_DIV 8
+#define ADAPT_COARSE_DIV 64
+
+static inline bool tree_coarse(Tree *tree)
+{
+    return atomic_load_explicit(&tree->coarse, memory_order_relaxed);
+}
+
+/* count operation done under exclusive lock, called with it held */
+static void tree_adapt(Tree *tree, bool waited)
+{
+    uint64_t fails;
+    int contended;
+    bool coarse;
+
+    /* without lock there is only one thread, coarse mode it is; fixed coarse stays */
+    if ((tree->flags & (AA_TREE_ADAPTIVE | AA_TREE_NO_LOCK | AA_TREE_COARSE)) != AA_TREE_ADAPTIVE)
+        return;
+    tree->adapt.waits += waited;
+    if (++tree->adapt.ops < ADAPT_WINDOW)
+        return;
+
+    fails = atomic_load_explicit(&tree->stats[AA_STAT_ACQUIRE_FAILS], memory_order_relaxed)
+        + atomic_load_explicit(&tree->stats[AA_STAT_INSERT_CONFLICTS], memory_order_relaxed);
+    contended = tree->adapt.waits + (int)(fails - tree->adapt.fails);
+
+    coarse = tree_coarse(tree);
+    if (coarse && contended >= ADAPT_WINDOW / ADAPT_FINE_DIV)
+        coarse = false;
+    else if (!coarse && contended < ADAPT_WINDOW / ADAPT_COARSE_DIV)
+        coarse = true;
+    if (coarse != tree_coarse(tree)) {
+        atomic_store_explicit(&tree->coarse, coarse, memory_order_relaxed);
+        tree_stat_add(tree, AA_STAT_MODE_SWITCHES, 1);
+    }
+
+    tree->adapt.ops = 0;
+    tree->adapt.waits = 0;
+    tree->adapt.fails = fails;
+}
+
+/*
+ * Node x with its parent, grandparent, children and grandchildren is
+ * what an in-place change under the shared lock must hold: replace,
+ * through acquire_stable().  Insert under the shared lock holds its
+ * two nodes the same way.  Skew and split themselves only run under
+ * the exclusive lock, where no one else holds nodes, so they acquire
+ * nothing.
+ *
+ * Nodes are acquired in address order.  Thread then only ever waits
+ * for a node above all it holds, so there is no cycle of waiters and
+ * busy node can be waited for without dropping what is held already.
+ * Links are read before nodes are held, so they are read again after;
+ * if they moved meanwhile everything is released and collected anew.
+ */
+#define MAX_ACQUIRED_NODES 10
+
+/* collect distinct nodes rebalancing of x touches, sorted by address */
+static int rebalancing_collect(Node *x, Node *nodes[MAX_ACQUIRED_NODES])
+{
+    Node *x_parent = node_atomic_get_parent(x);
+    Node *x_parent_parent = node_atomic_get_parent(x_parent);
+    Node *x_left = node_atomic_get_left(x);
+    Node *x_right = node_atomic_get_right(x);
+    Node *x_left_right = (x_left != NIL) ? node_atomic_get_right(x_left) : NIL;
+    Node *x_right_left = (x_right != NIL) ? node_atomic_get_left(x_right) : NIL;
+    Node *x_right_right = (x_right != NIL) ? node_atomic_get_right(x_right) : NIL;
+    Node *wanted[] = { x, x_parent, x_parent_parent, x_left, x_right,
+                       x_left_right, x_right_left, x_right_right };
+    int count = 0, j;
+
+    for (int i = 0; i < (int)ARRAY_NELEM(wanted); i++) {
+        Node *n = wanted[i];
+
+        if (n == NIL)
+            continue;
+        for (j = count; j > 0 && (uintptr_t)nodes[j - 1] > (uintptr_t)n; j--)
+            nodes[j] = nodes[j - 1];
+        if (j > 0 && nodes[j - 1] == n) {
+            /* duplicate, undo the shift */
+            for (; j < count; j++)
+                nodes[j] = nodes[j + 1];
+            continue;
         }
+        nodes[j] = n;
+        count++;
     }
-    return false;
+    return count;
 }
 
-static inline void rebalancing_release(Node* acquired[MAX_ACQUIRED_NODES]) {
+static inline void rebalancing_release(Node* acquired[MAX_ACQUIRED_NODES], int tag) {
     for (int i = 0; i < MAX_ACQUIRED_NODES; ++i) {
         if (acquired[i] != NIL) {
-            node_atomic_set_state(acquired[i], Open);
+            node_release_state(acquired[i], tag);
+        }
+    }
+}
+
+static void backoff(int fails)
+{
+    int spins = 1 << (fails < BACKOFF_MAX_SHIFT ? fails : BACKOFF_MAX_SHIFT);
+
+    while (spins--)
+        cpu_relax();
+}
+
+/* acquire node, waiting while others hold it */
+static void node_acquire_wait(Tree *tree, Node *node, int tag, int *fails_p, uint64_t *start_p)
+{
+    int state;
+
+    while (!atomic_rebalancing_state_compare_exchange_weak(node, Open, tag)) {
+        if ((*fails_p)++ == 0)
+            *start_p = now_ns();
+        state = atomic_load(&node->state);
+        if (desc_help(tree, state))
+            continue;
+        if (*fails_p < BACKOFF_PARK_AFTER)
+            backoff(*fails_p);
+        else
+            node_park(tree, node);
+    }
+}
+
+static void rebalancing_acquire_wait(Tree *tree, Node *x, Node *acquired[MAX_ACQUIRED_NODES], int tag)
+{
+    Node *nodes[MAX_ACQUIRED_NODES], *check[MAX_ACQUIRED_NODES];
+    uint64_t start = 0;
+    int count, i, fails = 0;
+
+    while (true) {
+        for (i = 0; i < MAX_ACQUIRED_NODES; i++)
+            acquired[i] = NIL;
+
+        count = rebalancing_collect(x, nodes);
+        for (i = 0; i < count; i++) {
+            node_acquire_wait(tree, nodes[i], tag, &fails, &start);
+            acquired[i] = nodes[i];
         }
+
+        if (rebalancing_collect(x, check) == count
+            && memcmp(check, nodes, count * sizeof(Node *)) == 0)
+            break;
+
+        rebalancing_release(acquired, tag);
+    }
+
+    if (unlikely(fails > 0)) {
+        tree_stat_add(tree, AA_STAT_ACQUIRE_FAILS, fails);
+        tree_stat_add(tree, AA_STAT_WAIT_NS, now_ns() - start);
     }
 }
 
@@ -305,42 +817,21 @@ static inline Node * split(Node *x)
 /* insert is easy */
 static Node *rebalance_on_insert(Node *current)
 {
-    Node* new_head;
-    Node* acquired[MAX_ACQUIRED_NODES];
-
-    while (true) {
-        if (rebalancing_acquire(current, acquired, Insert))
-            break;
-    }
-
     /* Apply skew and split */
     Node *skewed = skew(current);
-    new_head = split(skewed);
-
-    /* Release all nodes that were in the acquired array */
-    rebalancing_release(acquired);
-
-    return new_head;
+    return split(skewed);
 }
 
 /* remove is bit more tricky */
 static Node *rebalance_on_remove(Node *current)
 {
-    enum AANodeState expected;
-    Node* acquired[MAX_ACQUIRED_NODES];
-
     /*
      * Removal can create a gap in levels,
      * fix it by lowering current->level.
      */
 
-    /* announce rebalancing by CAS */
-    if (current != NIL) {
-        while (true) {
-            if (rebalancing_acquire(current, acquired, Open))
-                break;
-        }
-    }
+    if (current == NIL)
+        return current;
 
     Node *left_node = node_atomic_get_left(current);
     Node *right_node = node_atomic_get_right(current);
@@ -371,143 +862,495 @@ static Node *rebalance_on_remove(Node *current)
         node_atomic_set_right(current, split(right_node));
     }
 
-    rebalancing_release(acquired);
-
     return current;
 }
 
 /*
- * Recursive insertion
+ * Built-in key compare
+ *
+ * Keys live right after the node.  Compare is done as
+ * (a > b) - (a < b), which cannot overflow like a - b and compiles
+ * to flag-setting instructions without branches.  Tree remembers
+ * which of them it was given, so tree_cmp() calls them directly
+ * and the compiler can inline them into the search loops.
  */
 
-static Node * insert_sub(Tree *tree, Node *current, Node *prev, uintptr_t value, Node *node)
-{
-    int cmp;
-
-    if (current == NIL) {
-        enum AANodeState expected = Open;
-
-        /*
-         * Retry insert if acquiring node failed.
-         */
-        Assert(node->state == Open);
-
-        if (prev != NIL && !atomic_compare_exchange_weak(&prev->state, &expected, Insert)) {
-            printf("fallback\n");
-            return NIL;
-        }
-
-        /*
-         * Init node as late as possible, to avoid corrupting
-         * the tree in case it is already added.
-         */
-        node_atomic_set_parent(node, NIL);
-        node_atomic_set_left(node, NIL);
-        node_atomic_set_right(node, NIL);
-        node_atomic_set_level(node, 1);
+enum KeyType {
+    KEY_CUSTOM = 0,
+    KEY_I32,
+    KEY_U32,
+    KEY_I64,
+    KEY_U64,
+    KEY_PTR,
+    KEY_STR,
+};
 
-        atomic_fetch_add(&tree->count, 1);
+#define KEY_CMP(a, b) (((a) > (b)) - ((a) < (b)))
 
-        return node;
-    }
-
-    /* recursive insert */
+int aatree_cmp_i32(uintptr_t value, Node *node)
+{
+    return KEY_CMP((int32_t)value, AATREE_NODE_KEY(node, int32_t));
+}
 
-    cmp = tree->node_cmp(value, current);
-    if (cmp > 0) {
-        Node* current_right = node_atomic_get_right(current);
+int aatree_cmp_u32(uintptr_t value, Node *node)
+{
+    return KEY_CMP((uint32_t)value, AATREE_NODE_KEY(node, uint32_t));
+}
 
-        if (current_right == current) {
-            printf("broken\n");
-            abort();
-        }
+int aatree_cmp_i64(uintptr_t value, Node *node)
+{
+    return KEY_CMP((int64_t)value, AATREE_NODE_KEY(node, int64_t));
+}
 
-        Node* tmp = insert_sub(tree, current_right, current, value, node);
+int aatree_cmp_u64(uintptr_t value, Node *node)
+{
+    return KEY_CMP((uint64_t)value, AATREE_NODE_KEY(node, uint64_t));
+}
 
-        if (tmp == NIL) {
-            /*
-             * CAS fail retry
-             */
-            return NIL;
-        }
+int aatree_cmp_ptr(uintptr_t value, Node *node)
+{
+    return KEY_CMP(value, (uintptr_t)AATREE_NODE_KEY(node, void *));
+}
 
-        if (tmp != current_right) {
-            node_atomic_set_right(current, tmp);
-            node_atomic_set_parent(tmp, current);
-        }
+/*
+ * String keys compare prefixes first.  Prefix is zero-padded, so
+ * when prefixes differ they give the memcmp order; only on a tie
+ * key data is read, skipping the bytes prefix already covered.
+ */
+void aatree_str_key_init(struct AAStrKey *key, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t prefix = 0;
+
+    for (size_t i = 0; i < sizeof(prefix); i++)
+        prefix = (prefix << 8) | (i < len ? p[i] : 0);
+    key->prefix = prefix;
+    key->data = data;
+    key->len = len;
+}
 
-    } else if (cmp < 0) {
-        Node* current_left = node_atomic_get_left(current);
+static inline int str_key_cmp(const struct AAStrKey *a, const struct AAStrKey *b)
+{
+    size_t len, skip;
+    int cmp;
 
-        // debug
-        if (current_left == current) {
-            printf("broken\n");
-            abort();
-        }
+    if (likely(a->prefix != b->prefix))
+        return (a->prefix > b->prefix) ? 1 : -1;
 
-        Node* tmp = insert_sub(tree, current_left, current, value, node);
+    len = (a->len < b->len) ? a->len : b->len;
+    skip = (len < sizeof(a->prefix)) ? len : sizeof(a->prefix);
+    cmp = memcmp((const char *)a->data + skip, (const char *)b->data + skip, len - skip);
+    if (cmp != 0)
+        return cmp;
+    return KEY_CMP(a->len, b->len);
+}
 
-        if (tmp == NIL) {
-            /*
-             * CAS fail retry
-             */
-            return NIL;
-        }
+int aatree_cmp_str(uintptr_t value, Node *node)
+{
+    return str_key_cmp((const struct AAStrKey *)value,
+                       &container_of(node, struct AAStrNode, node)->key);
+}
 
-        if (tmp != current_left) {
-            node_atomic_set_left(current, tmp);
-            node_atomic_set_parent(tmp, current);
-        }
+static enum KeyType key_type_of(aatree_cmp_f cmpfn)
+{
+    if (cmpfn == aatree_cmp_i32)
+        return KEY_I32;
+    if (cmpfn == aatree_cmp_u32)
+        return KEY_U32;
+    if (cmpfn == aatree_cmp_i64)
+        return KEY_I64;
+    if (cmpfn == aatree_cmp_u64)
+        return KEY_U64;
+    if (cmpfn == aatree_cmp_ptr)
+        return KEY_PTR;
+    if (cmpfn == aatree_cmp_str)
+        return KEY_STR;
+    return KEY_CUSTOM;
+}
 
-    } else {
-        /* already exists? */
-        return current;
+/* key_type is constant in specialized callers, so the switch folds away */
+static inline int key_cmp(Tree *tree, enum KeyType key_type, uintptr_t value, Node *node)
+{
+    switch (key_type) {
+    case KEY_I32: return aatree_cmp_i32(value, node);
+    case KEY_U32: return aatree_cmp_u32(value, node);
+    case KEY_I64: return aatree_cmp_i64(value, node);
+    case KEY_U64: return aatree_cmp_u64(value, node);
+    case KEY_PTR: return aatree_cmp_ptr(value, node);
+    case KEY_STR: return aatree_cmp_str(value, node);
+    default: return tree->node_cmp(value, node);
     }
-
-    return rebalance_on_insert(current);
 }
 
-void aatree_insert(Tree *tree, uintptr_t value, Node *node)
+static inline int tree_cmp(Tree *tree, uintptr_t value, Node *node)
 {
-    /* Ensure node is in Open state before insertion */
-    node_atomic_set_state(node, Open);
-    
-    /* Acquire write lock - serializes insertions but keeps internal algorithm lock-free */
-    pthread_rwlock_wrlock(&tree->rw_lock);
-    
-    while (true) {
-        Node* old_root = atomic_load_explicit(&tree->root, memory_order_acquire);
-        Node* new_root = insert_sub(tree, old_root, NIL, value, node);
-        
-        if (new_root == NIL) {
-            /* CAS failed in insert_sub, retry */
-            continue;
-        }
-        
-        /* Update root */
-        atomic_store_explicit(&tree->root, new_root, memory_order_release);
-        break;
-    }
-    
-    pthread_rwlock_unlock(&tree->rw_lock);
+    return key_cmp(tree, tree->key_type, value, node);
 }
 
 /*
- * Recursive removal
+ * Acquire node for in-place change.  Links are read before the node
+ * itself is acquired, so make sure they did not move meanwhile.
  */
-
-/* remove_sub could be used for that, but want to avoid comparisions */
-static Node *steal_leftmost(Tree *tree, Node *current, Node **save_p)
+static void acquire_stable(Tree *tree, Node *x, Node *acquired[MAX_ACQUIRED_NODES], int tag)
 {
-    Node *left = node_atomic_get_left(current);
-    if (left == NIL) {
-        *save_p = current;
-        return node_atomic_get_right(current);
-    }
+    Node *parent, *left, *right;
 
-    node_atomic_set_left(current, steal_leftmost(tree, left, save_p));
-    return rebalance_on_remove(current);
-}
+    while (true) {
+        parent = node_atomic_get_parent(x);
+        left = node_atomic_get_left(x);
+        right = node_atomic_get_right(x);
+
+        rebalancing_acquire_wait(tree, x, acquired, tag);
+        if (parent == node_atomic_get_parent(x)
+            && left == node_atomic_get_left(x)
+            && right == node_atomic_get_right(x))
+            return;
+        rebalancing_release(acquired, tag);
+    }
+}
+
+/* is node still reachable from its parent */
+static bool node_is_linked(Tree *tree, Node *node)
+{
+    Node *parent = node_atomic_get_parent(node);
+
+    if (parent == NIL)
+        return atomic_load(&tree->root) == node;
+    return node_atomic_get_left(parent) == node || node_atomic_get_right(parent) == node;
+}
+
+/*
+ * Put node in place of acquired old one.  New node is fully set up
+ * before parent link is switched, so readers see either old or new.
+ * New node is not visible yet, links of others go through descriptor.
+ */
+static void replace_links(Tree *tree, Node *old, Node *node, struct OpDesc *d)
+{
+    Node *left = node_atomic_get_left(old);
+    Node *right = node_atomic_get_right(old);
+    Node *parent = node_atomic_get_parent(old);
+
+    node_atomic_set_left(node, left);
+    node_atomic_set_right(node, right);
+    node_atomic_set_parent(node, parent);
+    node_atomic_set_level(node, node_atomic_get_level(old));
+    if (left != NIL)
+        desc_write(d, &left->parent, old, node);
+    if (right != NIL)
+        desc_write(d, &right->parent, old, node);
+
+    if (parent == NIL)
+        desc_write(d, &tree->root, old, node);
+    else if (node_atomic_get_left(parent) == old)
+        desc_write(d, &parent->left, old, node);
+    else
+        desc_write(d, &parent->right, old, node);
+}
+
+
+/*
+ * Path through the tree
+ *
+ * Insert and remove record the nodes passed on the way down, and
+ * rebalance on the way back up from that array instead of from
+ * recursion.  AA-tree height is at most twice log2 of node count, so
+ * the array is never full.
+ */
+
+#define PATH_MAX_DEPTH (2 * 8 * sizeof(void *))
+
+/* put child under parent on given side, or make it root */
+static inline void path_link(Tree *tree, Node *parent, bool right, Node *child)
+{
+    if (parent == NIL)
+        atomic_store_explicit(&tree->root, child, memory_order_release);
+    else if (right)
+        node_atomic_set_right(parent, child);
+    else
+        node_atomic_set_left(parent, child);
+    if (child != NIL)
+        node_atomic_set_parent(child, parent);
+}
+
+/*
+ * Equal nodes of duplicate mode are in insertion order, and descent
+ * may meet any of them first.  Those before it are in its left
+ * subtree, the first one is found there.
+ */
+static Node *first_equal(Tree *tree, uintptr_t value, Node *equal)
+{
+    Node *current;
+
+    if (!(tree->flags & AA_TREE_DUPLICATES))
+        return equal;
+
+    current = node_atomic_get_left(equal);
+    while (current != NIL) {
+        if (tree_cmp(tree, value, current) == 0) {
+            equal = current;
+            current = node_atomic_get_left(current);
+        } else {
+            current = node_atomic_get_right(current);
+        }
+    }
+    return equal;
+}
+
+/*
+ * Iterative insertion
+ *
+ * Node with equal value is stored into *existing_p, and either left
+ * in place or replaced with new node.  Nothing changes in the tree
+ * in the first case, so rebalancing is skipped.
+ *
+ * Duplicate insert goes right on equal values, so new node lands
+ * after all equal ones and they stay in insertion order.
+ *
+ * Skew and split of a node look at its children and right grandchild
+ * only.  Once two nodes in a row come out of them unchanged, nodes
+ * above see the same children at the same levels as before the
+ * insert, so going further up would change nothing.  Most inserts
+ * stop after a level or two.
+ */
+
+enum InsertMode {
+    INSERT_UNIQUE,	/* keep existing node */
+    INSERT_REPLACE,	/* put new node in place of existing one */
+    INSERT_DUPLICATE,	/* link new node after equal ones */
+};
+
+/* called with exclusive lock held, nobody else holds nodes */
+static void insert_path(Tree *tree, uintptr_t value, Node *node,
+                        Node **existing_p, enum InsertMode mode)
+{
+    Node *path[PATH_MAX_DEPTH];
+    bool right[PATH_MAX_DEPTH];
+    Node *current, *prev, *top;
+    int depth = 0, unchanged = 0, level, cmp;
+
+    current = atomic_load_explicit(&tree->root, memory_order_acquire);
+    while (current != NIL) {
+        cmp = tree_cmp(tree, value, current);
+        if (cmp == 0 && mode != INSERT_DUPLICATE) {
+            /* already exists */
+            current = first_equal(tree, value, current);
+            *existing_p = current;
+            if (mode == INSERT_REPLACE)
+                replace_links(tree, current, node, NULL);
+            return;
+        }
+        Assert(depth < (int)PATH_MAX_DEPTH);
+        path[depth] = current;
+        right[depth] = cmp >= 0;
+        current = right[depth] ? node_atomic_get_right(current) : node_atomic_get_left(current);
+        depth++;
+    }
+
+    prev = depth ? path[depth - 1] : NIL;
+    Assert(node->state == Open);
+
+    /*
+     * Init node as late as possible, to avoid corrupting
+     * the tree in case it is already added.
+     */
+    node_atomic_set_left(node, NIL);
+    node_atomic_set_right(node, NIL);
+    node_atomic_set_level(node, 1);
+    path_link(tree, prev, depth && right[depth - 1], node);
+    tree_count_add(tree, 1);
+
+    for (int i = depth - 1; i >= 0 && unchanged < 2; i--) {
+        level = node_atomic_get_level(path[i]);
+        top = rebalance_on_insert(path[i]);
+        /* skew and split together bring the same node back on top, one level up */
+        if (top == path[i] && node_atomic_get_level(top) == level) {
+            unchanged++;
+            continue;
+        }
+        unchanged = 0;
+        path_link(tree, i ? path[i - 1] : NIL, i && right[i - 1], top);
+    }
+}
+
+/*
+ * Insert under shared lock
+ *
+ * New node goes in as a leaf at level 1.  As right child of a level 1
+ * node whose own link from parent is not horizontal, it makes a single
+ * right horizontal link, which is valid, so neither skew nor split
+ * would change anything on the way up.  Such insert only holds the
+ * leaf's parent and grandparent for a few stores, and runs next to
+ * searches, replaces and other such inserts.
+ *
+ * Shape of the tree changes only under the exclusive lock, so the slot
+ * found by descent stays the one for the value; it can only be taken
+ * by another insert meanwhile.  Then descent is tried again, a few
+ * times, before going to the exclusive lock like inserts that need
+ * rebalancing.
+ */
+
+#define INSERT_SHARED_TRIES 3
+
+enum SharedChange {
+    SHARED_DONE,	/* inserted or removed, or nothing to do */
+    SHARED_BUSY,	/* another thread got there first */
+    SHARED_REBALANCE,	/* needs skew/split, exclusive lock */
+};
+
+static enum SharedChange insert_shared(Tree *tree, uintptr_t value, Node *node,
+                                       Node **existing_p, enum InsertMode mode)
+{
+    Node *nodes[2], *parent = NIL, *grand, *current;
+    enum SharedChange res = SHARED_BUSY;
+    uint64_t start = 0;
+    int cmp = -1, count, i, fails = 0;
+
+    current = atomic_load(&tree->root);
+    while (current != NIL) {
+        cmp = tree_cmp(tree, value, current);
+        if (cmp == 0 && mode != INSERT_DUPLICATE) {
+            *existing_p = first_equal(tree, value, current);
+            return SHARED_DONE;
+        }
+        parent = current;
+        current = (cmp < 0) ? node_atomic_get_left(current) : node_atomic_get_right(current);
+    }
+    if (parent == NIL || cmp < 0)
+        return SHARED_REBALANCE;
+
+    /* hold parent and grandparent, in address order like rebalancing */
+    grand = node_atomic_get_parent(parent);
+    nodes[0] = parent;
+    nodes[1] = grand;
+    count = (grand != NIL) ? 2 : 1;
+    if (count == 2 && (uintptr_t)grand < (uintptr_t)parent) {
+        nodes[0] = grand;
+        nodes[1] = parent;
+    }
+    for (i = 0; i < count; i++)
+        node_acquire_wait(tree, nodes[i], 0, &fails, &start);
+
+    if (node_atomic_get_right(parent) == NIL
+        && node_atomic_get_parent(parent) == grand
+        && (grand == NIL ? atomic_load(&tree->root) == parent
+            : node_atomic_get_left(grand) == parent || node_atomic_get_right(grand) == parent)) {
+        if (node_atomic_get_level(parent) != 1
+            || (grand != NIL && node_atomic_get_right(grand) == parent
+                && node_atomic_get_level(grand) == 1)) {
+            res = SHARED_REBALANCE;
+        } else {
+            node_atomic_set_left(node, NIL);
+            node_atomic_set_right(node, NIL);
+            node_atomic_set_parent(node, parent);
+            node_atomic_set_level(node, 1);
+            node_atomic_set_right(parent, node);
+            tree_count_add(tree, 1);
+            res = SHARED_DONE;
+        }
+    }
+
+    while (i-- > 0)
+        node_release_state(nodes[i], 0);
+    return res;
+}
+
+/* insert or replace node, returns node with same value found in tree */
+static Node *insert_node(Tree *tree, uintptr_t value, Node *node, enum InsertMode mode)
+{
+    enum SharedChange res = SHARED_REBALANCE;
+    Node *existing = NULL;
+    int tries = 0;
+    bool waited;
+
+    /* Ensure node is in Open state before insertion */
+    node_atomic_set_state(node, Open);
+
+    /* replaced node must be waited out by readers, that needs exclusive lock anyway */
+    if (mode != INSERT_REPLACE && !tree_coarse(tree)) {
+        tree_rdlock(tree);
+        do {
+            res = insert_shared(tree, value, node, &existing, mode);
+        } while (res == SHARED_BUSY && ++tries < INSERT_SHARED_TRIES);
+        tree_rdunlock(tree);
+
+        if (tries > 0)
+            tree_stat_add(tree, AA_STAT_INSERT_CONFLICTS, tries);
+        if (res == SHARED_DONE)
+            return existing;
+        if (res == SHARED_BUSY)
+            tree_stat_add(tree, AA_STAT_INSERT_FALLBACKS, 1);
+    }
+
+    /* Acquire write lock - serializes insertions but keeps internal algorithm lock-free */
+    waited = tree_wrlock(tree);
+    tree_stat_add(tree, AA_STAT_INSERT_EXCLUSIVE, 1);
+
+    insert_path(tree, value, node, &existing, mode);
+
+    tree_adapt(tree, waited);
+    tree_wrunlock(tree);
+
+    return existing;
+}
+
+void aatree_insert(Tree *tree, uintptr_t value, Node *node)
+{
+    if (tree->flags & AA_TREE_DUPLICATES)
+        insert_node(tree, value, node, INSERT_DUPLICATE);
+    else
+        insert_node(tree, value, node, INSERT_UNIQUE);
+}
+
+/* returns node that is in tree after the call, either new or existing one */
+Node *aatree_insert_or_get(Tree *tree, uintptr_t value, Node *node)
+{
+    Node *existing = insert_node(tree, value, node, INSERT_UNIQUE);
+    return existing ? existing : node;
+}
+
+/* returns replaced node, or NULL if value was not in tree */
+Node *aatree_upsert(Tree *tree, uintptr_t value, Node *node)
+{
+    return insert_node(tree, value, node, INSERT_REPLACE);
+}
+
+/*
+ * Iterative removal
+ *
+ * Rebalancing after removal only lowers a node whose child got too
+ * low.  Node that comes out of it unchanged keeps its level, so
+ * nodes above have nothing to fix and rebalancing stops there.
+ */
+
+static void release_nodes(Tree *tree, Node **nodes, int count);
+
+/* remove leftmost node of subtree into *save_p, returns new subtree root */
+static Node *steal_leftmost(Node *current, Node **save_p)
+{
+    Node *path[PATH_MAX_DEPTH];
+    Node *left, *top;
+    int depth = 0, level;
+
+    while ((left = node_atomic_get_left(current)) != NIL) {
+        Assert(depth < (int)PATH_MAX_DEPTH);
+        path[depth++] = current;
+        current = left;
+    }
+    *save_p = current;
+    top = node_atomic_get_right(current);
+
+    while (depth-- > 0) {
+        node_atomic_set_left(path[depth], top);
+        if (top != NIL)
+            node_atomic_set_parent(top, path[depth]);
+
+        level = node_atomic_get_level(path[depth]);
+        top = rebalance_on_remove(path[depth]);
+        if (top == path[depth] && node_atomic_get_level(top) == level)
+            return path[0];
+    }
+    return top;
+}
 
 /* drop this node from tree */
 static Node *drop_this_node(Tree *tree, Node *old)
@@ -526,135 +1369,1504 @@ static Node *drop_this_node(Tree *tree, Node *old)
          * due to asymmetry of the AA-tree.  It will result in
          * less tree operations in the long run,
          */
-        node_atomic_set_right(old, steal_leftmost(tree, right, &new));
+        right = steal_leftmost(right, &new);
+        node_atomic_set_right(old, right);
 
         /* take old node's place */
         *new = *old;
+        node_atomic_set_parent(left, new);
+        if (right != NIL)
+            node_atomic_set_parent(right, new);
     }
 
-    /* cleanup for old node */
-    if (tree->release_cb)
-        tree->release_cb(old, tree);
+    /* keep parent pointers valid for walkers */
+    if (new != NIL)
+        node_atomic_set_parent(new, node_atomic_get_parent(old));
 
-    int old_count = atomic_load(&tree->count);
-    atomic_store(&tree->count, old_count - 1);
+    /* cleanup for old node, batch callback gets a batch of one */
+    release_nodes(tree, &old, 1);
+
+    tree_count_add(tree, -1);
 
     return new;
 }
 
-static Node *remove_sub(Tree *tree, Node *current, uintptr_t value)
+static bool remove_path(Tree *tree, uintptr_t value, aatree_pred_f pred, void *arg)
 {
-    int cmp;
+    Node *path[PATH_MAX_DEPTH];
+    bool right[PATH_MAX_DEPTH];
+    Node *current, *found = NIL, *top;
+    int depth = 0, found_depth = 0, level, cmp;
+
+    current = tree->root;
+    while (current != NIL) {
+        cmp = tree_cmp(tree, value, current);
+        if (cmp == 0) {
+            found = current;
+            found_depth = depth;
+            /* duplicate mode removes the first equal node, go on to the left */
+            if (!(tree->flags & AA_TREE_DUPLICATES))
+                break;
+        }
+        Assert(depth < (int)PATH_MAX_DEPTH);
+        path[depth] = current;
+        right[depth] = cmp > 0;
+        current = right[depth] ? node_atomic_get_right(current) : node_atomic_get_left(current);
+        depth++;
+    }
+    current = found;
+    depth = found_depth;
 
     /* not found? */
+    if (current == NIL || (pred && !pred(current, arg)))
+        return false;
+
+    top = rebalance_on_remove(drop_this_node(tree, current));
+    path_link(tree, depth ? path[depth - 1] : NIL, depth && right[depth - 1], top);
+
+    while (depth-- > 0) {
+        level = node_atomic_get_level(path[depth]);
+        top = rebalance_on_remove(path[depth]);
+        if (top == path[depth] && node_atomic_get_level(top) == level)
+            break;
+        path_link(tree, depth ? path[depth - 1] : NIL, depth && right[depth - 1], top);
+    }
+    return true;
+}
+
+/*
+ * Remove under shared lock
+ *
+ * Level 1 node leaves the tree without any rebalancing when it has a
+ * right horizontal child, which then takes its place and level, or
+ * when it has no child and hangs off a level 1 parent by horizontal
+ * link.  Such removal holds the node with its neighbourhood through
+ * acquire_stable(), like replace, and runs next to searches, replaces
+ * and shared inserts.  Node is released only after a grace period.
+ * Everything else goes to the exclusive lock.  Predicate runs while
+ * the node is held, so it still sees the node exactly as removed.
+ */
+static enum SharedChange remove_shared(Tree *tree, uintptr_t value, aatree_pred_f pred, void *arg,
+                                       Node **removed_p)
+{
+    Node *acquired[MAX_ACQUIRED_NODES];
+    Node *current, *parent, *right;
+    enum SharedChange res = SHARED_REBALANCE;
+    int cmp;
+
+    current = atomic_load(&tree->root);
+    while (current != NIL) {
+        cmp = tree_cmp(tree, value, current);
+        if (cmp == 0)
+            break;
+        current = (cmp < 0) ? node_atomic_get_left(current) : node_atomic_get_right(current);
+    }
     if (current == NIL)
-        return current;
+        return SHARED_DONE;
+    current = first_equal(tree, value, current);
+    if (node_atomic_get_level(current) != 1)
+        return SHARED_REBALANCE;
+
+    acquire_stable(tree, current, acquired, 0);
+    parent = node_atomic_get_parent(current);
+    right = node_atomic_get_right(current);
+    if (!node_is_linked(tree, current)) {
+        res = SHARED_BUSY;
+    } else if (node_atomic_get_level(current) == 1
+               && (right != NIL || parent == NIL
+                   || (node_atomic_get_right(parent) == current
+                       && node_atomic_get_level(parent) == 1))) {
+        Assert(node_atomic_get_left(current) == NIL);
+        if (!pred || pred(current, arg)) {
+            if (right != NIL)
+                node_atomic_set_parent(right, parent);
+            if (parent == NIL)
+                atomic_store(&tree->root, right);
+            else if (node_atomic_get_left(parent) == current)
+                node_atomic_set_left(parent, right);
+            else
+                node_atomic_set_right(parent, right);
+            tree_count_add(tree, -1);
+            *removed_p = current;
+        }
+        res = SHARED_DONE;
+    }
+    rebalancing_release(acquired, 0);
+    return res;
+}
 
-    cmp = tree->node_cmp(value, current);
-    if (cmp > 0) {
-        Node *right = node_atomic_get_right(current);
-        node_atomic_set_right(current, remove_sub(tree, right, value));
-    } else if (cmp < 0) {
-        Node *left = node_atomic_get_left(current);
-        node_atomic_set_left(current, remove_sub(tree, left, value));
-    } else {
-        current = drop_this_node(tree, current);
+static bool remove_node(Tree *tree, uintptr_t value, aatree_pred_f pred, void *arg)
+{
+    enum SharedChange res;
+    Node *node = NULL;
+    bool removed, waited;
+
+    if (!tree_coarse(tree)) {
+        tree_rdlock(tree);
+        res = remove_shared(tree, value, pred, arg, &node);
+        tree_rdunlock(tree);
+
+        if (res == SHARED_DONE) {
+            if (!node)
+                return false;
+            grace_wait();
+            release_nodes(tree, &node, 1);
+            return true;
+        }
     }
 
-    return rebalance_on_remove(current);
+    waited = tree_wrlock(tree);
+    tree_stat_add(tree, AA_STAT_REMOVE_EXCLUSIVE, 1);
+    removed = remove_path(tree, value, pred, arg);
+    tree_adapt(tree, waited);
+    tree_wrunlock(tree);
+
+    return removed;
 }
 
 void aatree_remove(Tree *tree, uintptr_t value)
 {
-    tree->root = remove_sub(tree, tree->root, value);
+    remove_node(tree, value, NULL, NULL);
+}
+
+/*
+ * Remove node only if predicate agrees.  Predicate sees the node
+ * exactly as it is removed: held under the shared lock when removal
+ * needs no rebalancing, otherwise under the exclusive lock.
+ */
+bool aatree_remove_if(Tree *tree, uintptr_t value, aatree_pred_f pred, void *arg)
+{
+    return remove_node(tree, value, pred, arg);
+}
+
+/*
+ * Replace old node with new one.  Only old node and its neighbours
+ * are acquired, so other replaces and searches go on in parallel.
+ * In coarse mode it is done under exclusive lock instead, which also
+ * waits out the readers.  Returns false if old node was not in tree
+ * anymore.
+ */
+bool aatree_replace(Tree *tree, Node *old, Node *node)
+{
+    Node *acquired[MAX_ACQUIRED_NODES];
+    struct OpDesc desc;
+    bool linked, waited;
+
+    node_atomic_set_state(node, Open);
+
+    if (tree_coarse(tree)) {
+        waited = tree_wrlock(tree);
+        /* mode may have changed meanwhile, either way nobody holds nodes now */
+        linked = node_is_linked(tree, old);
+        if (linked)
+            replace_links(tree, old, node, NULL);
+        tree_adapt(tree, waited);
+        tree_wrunlock(tree);
+        return linked;
+    }
+
+    /* shared side keeps out writers that restructure the tree */
+    tree_rdlock(tree);
+
+    desc_begin(&desc, acquired, MAX_ACQUIRED_NODES);
+    acquire_stable(tree, old, acquired, atomic_load(&desc.tag));
+    linked = node_is_linked(tree, old);
+    if (linked)
+        replace_links(tree, old, node, &desc);
+    desc_run(&desc);
+    desc_end(&desc);
+
+    tree_rdunlock(tree);
+
+    /*
+     * Wait out readers that may still look at old node, then caller
+     * can free it, and helpers that may still look at the descriptor.
+     */
+    grace_wait();
+
+    return linked;
 }
 
 /*
  * Walking all nodes
+ *
+ * Walk is iterative, pending nodes are kept in a fixed-size stack.
+ * AA-tree height is at most 2 * log2(n + 1), so the stack can never
+ * overflow and there is no dependency on thread stack size.
+ *
+ * Low bits of stack entries tell what is pending:
+ *   none            - node itself, right subtree not started yet
+ *   WALK_SUBTREE    - whole subtree (pre-order keeps right children)
+ *   WALK_RIGHT_DONE - node whose right subtree is done (post-order)
+ *
+ * Children are always fetched before walker is called on the node,
+ * so walker may free it in any walk order.
+ *
+ * Either plain walker or visitor is given.  Visitor may stop the walk
+ * or skip the subtrees that are not entered yet: both subtrees in
+ * pre-order, right subtree in in-order, nothing in post-order.
  */
 
-static void walk_sub(Node *current, enum AATreeWalkType wtype,
-                     aatree_walker_f walker, void *arg)
+#define WALK_MAX_DEPTH (2 * 8 * sizeof(void *))
+#define WALK_SUBTREE ((uintptr_t)1)
+#define WALK_RIGHT_DONE ((uintptr_t)2)
+#define WALK_FLAGS (WALK_SUBTREE | WALK_RIGHT_DONE)
+
+#define WALK_VISIT(node) \
+    (walker ? (walker(node, arg), AA_WALK_CONTINUE) : visitor(node, arg))
+
+/* continue walk from current with stack already holding depth entries */
+static bool walk_stack(Node *current, uintptr_t *stack, int depth,
+                       enum AATreeWalkType wtype, aatree_walker_f walker,
+                       aatree_visitor_f visitor, void *arg)
 {
-    Node* current_left = node_atomic_get_left(current);
-    Node* current_right = node_atomic_get_right(current);
+    enum AATreeWalkResult res;
+    uintptr_t entry;
+    Node *left, *right;
 
-    if (current == NIL)
-        return;
+    while (true) {
+        /* go down along left edges */
+        while (current != NIL) {
+            left = node_atomic_get_left(current);
+            right = node_atomic_get_right(current);
+            prefetch(right);
+
+            if (wtype == AA_WALK_PRE_ORDER) {
+                res = WALK_VISIT(current);
+                if (res == AA_WALK_STOP)
+                    return true;
+                if (res == AA_WALK_SKIP)
+                    break;
+                if (right != NIL)
+                    stack[depth++] = (uintptr_t)right | WALK_SUBTREE;
+            } else {
+                stack[depth++] = (uintptr_t)current;
+            }
+            current = left;
+        }
 
-    switch (wtype) {
-        case AA_WALK_IN_ORDER:
-            walk_sub(current_left, wtype, walker, arg);
-            walker(current, arg);
-            walk_sub(current_right, wtype, walker, arg);
-            break;
-        case AA_WALK_POST_ORDER:
-            walk_sub(current_left, wtype, walker, arg);
-            walk_sub(current_right, wtype, walker, arg);
-            walker(current, arg);
-            break;
-        case AA_WALK_PRE_ORDER:
-            walker(current, arg);
-            walk_sub(current_left, wtype, walker, arg);
-            walk_sub(current_right, wtype, walker, arg);
-            break;
+        /* climb up until there is a subtree to enter */
+        do {
+            if (depth == 0)
+                return false;
+            entry = stack[--depth];
+            current = (Node *)(entry & ~WALK_FLAGS);
+
+            if (entry & WALK_SUBTREE)
+                break;
+
+            if (entry & WALK_RIGHT_DONE) {
+                if (WALK_VISIT(current) == AA_WALK_STOP)
+                    return true;
+                current = NIL;
+                continue;
+            }
+
+            right = node_atomic_get_right(current);
+            if (wtype == AA_WALK_IN_ORDER) {
+                res = WALK_VISIT(current);
+                if (res == AA_WALK_STOP)
+                    return true;
+                if (res == AA_WALK_SKIP)
+                    right = NIL;
+            } else if (right != NIL) {
+                stack[depth++] = entry | WALK_RIGHT_DONE;
+            } else if (WALK_VISIT(current) == AA_WALK_STOP) {
+                return true;
+            }
+            current = right;
+        } while (current == NIL);
     }
 }
 
+static void walk_sub(Node *current, enum AATreeWalkType wtype,
+                     aatree_walker_f walker, void *arg)
+{
+    uintptr_t stack[WALK_MAX_DEPTH];
+
+    walk_stack(current, stack, 0, wtype, walker, NULL, arg);
+}
+
 /* walk tree in correct order */
 void aatree_walk(Tree *tree, enum AATreeWalkType wtype, aatree_walker_f walker, void *arg)
 {
     walk_sub(tree->root, wtype, walker, arg);
 }
 
-/* walk tree in bottom-up order, so that walker can destroy the nodes */
-void aatree_destroy(Tree *tree)
+/* walk tree in correct order, until visitor says stop */
+bool aatree_walk_until(Tree *tree, enum AATreeWalkType wtype, aatree_visitor_f visitor, void *arg)
 {
-    walk_sub(tree->root, AA_WALK_POST_ORDER, tree->release_cb, tree);
-
-    /* reset tree */
-    tree->root = NIL;
-    tree->count = 0;
-    pthread_rwlock_destroy(&tree->rw_lock);
-}
+    uintptr_t stack[WALK_MAX_DEPTH];
 
-/* prepare tree */
-void aatree_init(Tree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb)
-{
-    tree->root = NIL;
-    tree->count = 0;
-    tree->node_cmp = cmpfn;
-    tree->release_cb = release_cb;
-    pthread_rwlock_init(&tree->rw_lock, NULL);
+    return walk_stack(tree->root, stack, 0, wtype, NULL, visitor, arg);
 }
 
 /*
- * search function
+ * Walk in order, starting from first node not less than value.
+ *
+ * Descent leaves on stack exactly the nodes that in-order walk
+ * would still have pending at that point, so walk just continues.
  */
-Node *aatree_search(Tree *tree, uintptr_t value)
+bool aatree_walk_from(Tree *tree, uintptr_t value, aatree_visitor_f visitor, void *arg)
 {
-    /* Acquire read lock - allows concurrent readers */
-    pthread_rwlock_rdlock(&tree->rw_lock);
-    
+    uintptr_t stack[WALK_MAX_DEPTH];
+    int depth = 0;
+    bool stopped;
+
+    tree_rdlock(tree);
+
     Node *current = atomic_load_explicit(&tree->root, memory_order_acquire);
 
-    /* Traverse tree */
     while (current != NIL) {
-        int cmp = tree->node_cmp(value, current);
-        if (cmp > 0)
+        if (tree_cmp(tree, value, current) > 0) {
             current = node_atomic_get_right(current);
-        else if (cmp < 0)
+        } else {
+            stack[depth++] = (uintptr_t)current;
             current = node_atomic_get_left(current);
-        else {
-            pthread_rwlock_unlock(&tree->rw_lock);
-            return current;
         }
     }
-    
-    pthread_rwlock_unlock(&tree->rw_lock);
+
+    stopped = walk_stack(NIL, stack, depth, AA_WALK_IN_ORDER, NULL, visitor, arg);
+
+    tree_rdunlock(tree);
+    return stopped;
+}
+
+/*
+ * Equal values walk.  Walk from first node not less than value
+ * already is at the first of equal nodes, so walk just continues
+ * until value changes, without new descent per node.
+ */
+
+struct EqualWalk {
+    Tree *tree;
+    uintptr_t value;
+    aatree_walker_f walker;
+    void *arg;
+    int count;
+};
+
+static enum AATreeWalkResult equal_visitor(Node *node, void *arg)
+{
+    struct EqualWalk *ew = arg;
+
+    if (tree_cmp(ew->tree, ew->value, node) != 0)
+        return AA_WALK_STOP;
+    if (ew->walker)
+        ew->walker(node, ew->arg);
+    ew->count++;
+    return AA_WALK_CONTINUE;
+}
+
+int aatree_walk_equal(Tree *tree, uintptr_t value, aatree_walker_f walker, void *arg)
+{
+    struct EqualWalk ew = { tree, value, walker, arg, 0 };
+
+    aatree_walk_from(tree, value, equal_visitor, &ew);
+    return ew.count;
+}
+
+int aatree_count_equal(Tree *tree, uintptr_t value)
+{
+    return aatree_walk_equal(tree, value, NULL, NULL);
+}
+
+/*
+ * Parallel walk
+ *
+ * Upper levels of the tree are cut into chunks: whole subtrees at
+ * split depth and single nodes above it, listed in walk order.
+ * Each worker gets a contiguous range of chunks and takes them from
+ * the front, idle workers steal from the back of other ranges.
+ * Partial results are per chunk, so reducing them in chunk order
+ * keeps the order of the walk.
+ */
+
+struct WalkChunk {
+    Node *node;
+    bool subtree;	/* whole subtree or just the node */
+    void *partial;
+};
+
+struct WalkWorker {
+    struct ParallelWalk *pw;
+    /* head in low 32 bits, tail in high 32 bits */
+    _Atomic(uint64_t) range;
+    pthread_t thread;
+    bool started;
+};
+
+struct ParallelWalk {
+    enum AATreeWalkType wtype;
+    aatree_walker_f walker;
+    struct WalkChunk *chunks;
+    struct WalkWorker *workers;
+    int nworkers;
+};
+
+#define RANGE_HEAD(r) ((uint32_t)(r))
+#define RANGE_TAIL(r) ((uint32_t)((r) >> 32))
+#define RANGE_MAKE(head, tail) ((uint64_t)(head) | ((uint64_t)(tail) << 32))
+
+static int plan_chunks(Node *node, int depth, enum AATreeWalkType wtype,
+                       struct WalkChunk *chunks, int n)
+{
+    Node *left, *right;
+
+    if (node == NIL)
+        return n;
+
+    if (depth == 0) {
+        chunks[n].node = node;
+        chunks[n].subtree = true;
+        return n + 1;
+    }
+
+    left = node_atomic_get_left(node);
+    right = node_atomic_get_right(node);
+
+    if (wtype == AA_WALK_PRE_ORDER) {
+        chunks[n].node = node;
+        chunks[n++].subtree = false;
+    }
+    n = plan_chunks(left, depth - 1, wtype, chunks, n);
+    if (wtype == AA_WALK_IN_ORDER) {
+        chunks[n].node = node;
+        chunks[n++].subtree = false;
+    }
+    n = plan_chunks(right, depth - 1, wtype, chunks, n);
+    if (wtype == AA_WALK_POST_ORDER) {
+        chunks[n].node = node;
+        chunks[n++].subtree = false;
+    }
+    return n;
+}
+
+/* owner takes chunks from the front of its range */
+static int chunk_take(struct WalkWorker *w)
+{
+    uint64_t r = atomic_load(&w->range);
+
+    while (RANGE_HEAD(r) < RANGE_TAIL(r)) {
+        if (atomic_compare_exchange_weak(&w->range, &r, RANGE_MAKE(RANGE_HEAD(r) + 1, RANGE_TAIL(r))))
+            return RANGE_HEAD(r);
+    }
+    return -1;
+}
+
+/* thieves take chunks from the back */
+static int chunk_steal(struct WalkWorker *w)
+{
+    uint64_t r = atomic_load(&w->range);
+
+    while (RANGE_HEAD(r) < RANGE_TAIL(r)) {
+        if (atomic_compare_exchange_weak(&w->range, &r, RANGE_MAKE(RANGE_HEAD(r), RANGE_TAIL(r) - 1)))
+            return RANGE_TAIL(r) - 1;
+    }
+    return -1;
+}
+
+static void *parallel_walk_worker(void *arg)
+{
+    struct WalkWorker *self = arg;
+    struct ParallelWalk *pw = self->pw;
+    int id = self - pw->workers;
+    struct WalkChunk *chunk;
+    int i, c;
+
+    while (true) {
+        c = chunk_take(self);
+        for (i = 1; c < 0 && i < pw->nworkers; i++)
+            c = chunk_steal(&pw->workers[(id + i) % pw->nworkers]);
+        if (c < 0)
+            break;
+
+        chunk = &pw->chunks[c];
+        if (chunk->subtree)
+            walk_sub(chunk->node, pw->wtype, pw->walker, chunk->partial);
+        else
+            pw->walker(chunk->node, chunk->partial);
+    }
     return NULL;
 }
 
+void aatree_parallel_walk_reduce(Tree *tree, enum AATreeWalkType wtype,
+                                 aatree_walker_f walker, aatree_partial_f partial_cb,
+                                 aatree_reduce_f reduce_cb, void *arg, int nthreads)
+{
+    struct ParallelWalk pw;
+    int depth, max_chunks, nchunks, i;
+
+    tree_rdlock(tree);
+
+    /* aim for ~8 subtrees per thread, so stealing can even out skew */
+    for (depth = 0; (1 << depth) < 8 * nthreads; depth++);
+    max_chunks = (2 << depth) - 1;
+
+    pw.wtype = wtype;
+    pw.walker = walker;
+    pw.nworkers = nthreads;
+    pw.chunks = (nthreads > 1) ? malloc(max_chunks * sizeof(*pw.chunks)) : NULL;
+    pw.workers = (nthreads > 1) ? malloc(nthreads * sizeof(*pw.workers)) : NULL;
+
+    if (!pw.chunks || !pw.workers) {
+        /* single chunk: the whole tree, walked by this thread */
+        void *partial = partial_cb ? partial_cb(arg) : arg;
+        walk_sub(tree->root, wtype, walker, partial);
+        if (reduce_cb)
+            reduce_cb(partial, arg);
+        goto out;
+    }
+
+    nchunks = plan_chunks(tree->root, depth, wtype, pw.chunks, 0);
+    for (i = 0; i < nchunks; i++)
+        pw.chunks[i].partial = partial_cb ? partial_cb(arg) : arg;
+
+    for (i = 0; i < nthreads; i++) {
+        pw.workers[i].pw = &pw;
+        atomic_init(&pw.workers[i].range,
+                    RANGE_MAKE((int64_t)nchunks * i / nthreads,
+                               (int64_t)nchunks * (i + 1) / nthreads));
+    }
+
+    /* calling thread is worker 0, ranges of workers that failed to start get stolen */
+    for (i = 1; i < nthreads; i++)
+        pw.workers[i].started = pthread_create(&pw.workers[i].thread, NULL,
+                                               parallel_walk_worker, &pw.workers[i]) == 0;
+    parallel_walk_worker(&pw.workers[0]);
+
+    for (i = 1; i < nthreads; i++) {
+        if (pw.workers[i].started)
+            pthread_join(pw.workers[i].thread, NULL);
+    }
+
+    if (reduce_cb) {
+        for (i = 0; i < nchunks; i++)
+            reduce_cb(pw.chunks[i].partial, arg);
+    }
+
+out:
+    free(pw.chunks);
+    free(pw.workers);
+    tree_rdunlock(tree);
+}
+
+/* walk tree in order using several threads, walker must be thread-safe */
+void aatree_parallel_walk(Tree *tree, aatree_walker_f walker, void *arg, int nthreads)
+{
+    aatree_parallel_walk_reduce(tree, AA_WALK_IN_ORDER, walker, NULL, NULL, arg, nthreads);
+}
+
+/*
+ * Node arena
+ *
+ * Tree-owned memory for nodes, carved from big chunks with atomic
+ * bump pointer.  Nodes are never freed one by one, all chunks go
+ * away together when tree is destroyed.
+ *
+ * NUMA arena has a shard of chunks per memory node and allocates
+ * from the shard of the calling CPU, so nodes live near the threads
+ * that insert them.  Shard chunks are bound to their memory node
+ * with mbind(), not relying on first touch.  Other systems than
+ * Linux see just one memory node.
+ */
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+#define ARENA_MAX_SHARDS (8 * (int)sizeof(unsigned long))
+#define ARENA_MPOL_PREFERRED 1
+/* calling thread re-reads its memory node after this many allocations */
+#define ARENA_NODE_RECHECK 64
+/* empty fixed free list, low half of free_top */
+#define FIXED_NONE UINT32_MAX
+#define FIXED_COUNT_ONE ((uint64_t)1 << 32)
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    USUAL_AATREE_ATOMIC(size_t) used;
+    size_t size;
+    char *data;
+};
+
+struct ArenaShard {
+    USUAL_AATREE_ATOMIC(struct ArenaChunk *) current;
+    int numa_node;	/* -1 if chunks are not bound */
+};
+
+struct AATreeArena {
+    pthread_mutex_t lock;
+    size_t node_size;
+    size_t chunk_size;
+    size_t capacity;	/* fixed arena node count, 0 if arena grows */
+    char *base;		/* fixed arena nodes */
+    USUAL_AATREE_ATOMIC(uint64_t) free_top;	/* change count above, top index below */
+    USUAL_AATREE_ATOMIC(uint32_t) *free_next;	/* next index in free list, per node */
+    int nshards;
+    struct ArenaShard shards[FLEX_ARRAY];
+};
+
+static int numa_node_count(void)
+{
+    int lo = 0, hi = 0;
+#ifdef __linux__
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    if (f) {
+        if (fscanf(f, "%d-%d", &lo, &hi) < 2)
+            hi = lo;
+        fclose(f);
+    }
+#endif
+    return (hi < ARENA_MAX_SHARDS) ? hi + 1 : ARENA_MAX_SHARDS;
+}
+
+static int numa_current_node(void)
+{
+    static _Thread_local int node, uses;
+
+#if defined(__linux__) && defined(SYS_getcpu)
+    if (uses++ % ARENA_NODE_RECHECK == 0) {
+        unsigned cpu, cur;
+        if (syscall(SYS_getcpu, &cpu, &cur, NULL) == 0)
+            node = cur;
+    }
+#endif
+    return node;
+}
+
+/* partial pages at chunk ends are left to first touch */
+static void numa_bind(void *addr, size_t len, int numa_node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = CUSTOM_ALIGN(addr, page);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(page - 1);
+    unsigned long mask = 1UL << numa_node;
+
+    /* failure is not fatal, memory is just placed by default policy */
+    if (end > start)
+        syscall(SYS_mbind, start, end - start, ARENA_MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0);
+#endif
+}
+
+static struct ArenaChunk *arena_chunk_new(struct AATreeArena *arena, struct ArenaShard *shard,
+                                          struct ArenaChunk *next)
+{
+    struct ArenaChunk *chunk = malloc(sizeof(*chunk) + ARENA_ALIGN + arena->chunk_size);
+    if (!chunk)
+        return NULL;
+    chunk->next = next;
+    chunk->size = arena->chunk_size;
+    chunk->data = (char *)CUSTOM_ALIGN(chunk + 1, ARENA_ALIGN);
+    atomic_init(&chunk->used, 0);
+    if (shard->numa_node >= 0)
+        numa_bind(chunk->data, chunk->size, shard->numa_node);
+    return chunk;
+}
+
+static void arena_free(struct AATreeArena *arena)
+{
+    struct ArenaChunk *chunk, *next;
+
+    for (int i = 0; i < arena->nshards; i++) {
+        chunk = atomic_load(&arena->shards[i].current);
+        while (chunk) {
+            next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->free_next);
+    free(arena);
+}
+
+/* fixed arena has capacity nodes in one chunk, 0 for growing arena */
+static bool arena_init(Tree *tree, size_t node_size, size_t capacity, int nshards, bool numa)
+{
+    struct AATreeArena *arena = malloc(offsetof(struct AATreeArena, shards) +
+                                       nshards * sizeof(struct ArenaShard));
+    struct ArenaShard *shard;
+    bool ok = true;
+
+    if (!arena)
+        return false;
+
+    arena->node_size = CUSTOM_ALIGN(node_size, ARENA_ALIGN);
+    arena->chunk_size = arena->node_size;
+    if (capacity)
+        arena->chunk_size = capacity * arena->node_size;
+    else if (arena->chunk_size < ARENA_CHUNK_SIZE)
+        arena->chunk_size = ARENA_CHUNK_SIZE - ARENA_CHUNK_SIZE % arena->node_size;
+    arena->nshards = nshards;
+    arena->capacity = capacity;
+    arena->base = NULL;
+    arena->free_next = capacity ? malloc(capacity * sizeof(*arena->free_next)) : NULL;
+    atomic_init(&arena->free_top, FIXED_NONE);
+    pthread_mutex_init(&arena->lock, NULL);
+
+    for (int i = 0; i < nshards; i++) {
+        shard = &arena->shards[i];
+        shard->numa_node = numa ? i : -1;
+        atomic_init(&shard->current, arena_chunk_new(arena, shard, NULL));
+        ok = ok && shard->current;
+    }
+    if (!ok || (capacity && !arena->free_next)) {
+        arena_free(arena);
+        return false;
+    }
+
+    tree->arena = arena;
+    return true;
+}
+
+bool aatree_arena_init(Tree *tree, size_t node_size)
+{
+    return arena_init(tree, node_size, 0, 1, false);
+}
+
+bool aatree_arena_init_numa(Tree *tree, size_t node_size)
+{
+    return arena_init(tree, node_size, 0, numa_node_count(), true);
+}
+
+/*
+ * Fixed arena
+ *
+ * All node memory is allocated and touched at init, so no later
+ * call mallocs or page faults.  Removed nodes go back to a free list
+ * instead of staying taken until destroy.  Free list is a stack of
+ * node indexes, top index shares one word with a change count, so
+ * pop that raced with pop and push of the same node fails its CAS.
+ * Next links are kept apart from node memory, which may be in use
+ * already when a losing pop reads it.  CAS is only retried when
+ * another thread changed the list, never with one thread.
+ */
+
+static void *fixed_get(struct AATreeArena *arena)
+{
+    uint64_t top = atomic_load(&arena->free_top), next;
+    uint32_t index;
+
+    do {
+        index = (uint32_t)top;
+        if (index == FIXED_NONE)
+            return NULL;
+        next = (top & ~(uint64_t)FIXED_NONE) + FIXED_COUNT_ONE + atomic_load(&arena->free_next[index]);
+    } while (!atomic_compare_exchange_weak(&arena->free_top, &top, next));
+
+    return arena->base + (size_t)index * arena->node_size;
+}
+
+/* nodes not from fixed arena are left alone */
+static void arena_put(struct AATreeArena *arena, void *mem)
+{
+    uint64_t top, next;
+    size_t offset;
+    uint32_t index;
+
+    if (!arena || !arena->capacity || (char *)mem < arena->base)
+        return;
+    offset = (char *)mem - arena->base;
+    if (offset >= arena->capacity * arena->node_size)
+        return;
+    index = offset / arena->node_size;
+
+    top = atomic_load(&arena->free_top);
+    do {
+        atomic_store(&arena->free_next[index], (uint32_t)top);
+        next = (top & ~(uint64_t)FIXED_NONE) + FIXED_COUNT_ONE + index;
+    } while (!atomic_compare_exchange_weak(&arena->free_top, &top, next));
+}
+
+bool aatree_init_fixed(Tree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags,
+                       size_t node_size, size_t capacity)
+{
+    struct AATreeArena *arena;
+
+    /* changes under exclusive lock only, no waiting on nodes */
+    aatree_init_flags(tree, cmpfn, release_cb, flags | AA_TREE_COARSE);
+    if (capacity == 0 || capacity >= FIXED_NONE || !arena_init(tree, node_size, capacity, 1, false)) {
+        aatree_destroy(tree);
+        return false;
+    }
+
+    arena = tree->arena;
+    arena->base = atomic_load(&arena->shards[0].current)->data;
+    memset(arena->base, 0, arena->chunk_size);
+    for (size_t i = 0; i < capacity; i++)
+        atomic_init(&arena->free_next[i], (i + 1 < capacity) ? i + 1 : FIXED_NONE);
+    atomic_store(&arena->free_top, 0);
+    return true;
+}
+
+void *aatree_arena_alloc(Tree *tree)
+{
+    struct AATreeArena *arena = tree->arena;
+    struct ArenaShard *shard = &arena->shards[0];
+    struct ArenaChunk *chunk, *fresh;
+    size_t offset;
+
+    if (arena->capacity)
+        return fixed_get(arena);
+
+    if (arena->nshards > 1)
+        shard = &arena->shards[numa_current_node() % arena->nshards];
+
+    while (true) {
+        chunk = atomic_load(&shard->current);
+        offset = atomic_fetch_add(&chunk->used, arena->node_size);
+        if (offset + arena->node_size <= chunk->size)
+            return chunk->data + offset;
+
+        /* chunk is full, first thread here adds a new one */
+        pthread_mutex_lock(&arena->lock);
+        if (atomic_load(&shard->current) == chunk) {
+            fresh = arena_chunk_new(arena, shard, chunk);
+            if (!fresh) {
+                pthread_mutex_unlock(&arena->lock);
+                return NULL;
+            }
+            atomic_store(&shard->current, fresh);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+void aatree_arena_free(Tree *tree, void *mem)
+{
+    arena_put(tree->arena, mem);
+}
+
+/*
+ * Batched release
+ *
+ * Nodes are collected into an array and handed to release_batch_cb
+ * when it fills up.  Post-order walk never comes back to a visited
+ * node, so delaying the release is safe.  Shared batch with direct
+ * flag releases each node at once, it is used when there is no
+ * memory for a private one.
+ */
+
+#define RELEASE_BATCH 256
+
+struct ReleaseBatch {
+    Tree *tree;
+    bool direct;
+    int count;
+    int total;
+    Node *nodes[RELEASE_BATCH];
+};
+
+static void release_nodes(Tree *tree, Node **nodes, int count)
+{
+    if (tree->release_batch_cb) {
+        tree->release_batch_cb(nodes, count, tree);
+    } else if (tree->release_cb) {
+        for (int i = 0; i < count; i++)
+            tree->release_cb(nodes[i], tree);
+    }
+    for (int i = 0; tree->arena && i < count; i++)
+        arena_put(tree->arena, nodes[i]);
+}
+
+static void release_batch_flush(struct ReleaseBatch *batch)
+{
+    if (batch->count > 0)
+        release_nodes(batch->tree, batch->nodes, batch->count);
+    batch->count = 0;
+}
+
+static void release_batch_add(Node *node, void *arg)
+{
+    struct ReleaseBatch *batch = arg;
+
+    if (batch->direct) {
+        release_nodes(batch->tree, &node, 1);
+        return;
+    }
+
+    batch->total++;
+
+    batch->nodes[batch->count++] = node;
+    if (batch->count == RELEASE_BATCH)
+        release_batch_flush(batch);
+}
+
+static void *release_batch_new(void *arg)
+{
+    struct ReleaseBatch *shared = arg;
+    struct ReleaseBatch *batch = malloc(sizeof(*batch));
+
+    if (!batch)
+        return shared;
+    batch->tree = shared->tree;
+    batch->direct = false;
+    batch->count = 0;
+    batch->total = 0;
+    return batch;
+}
+
+static void release_batch_done(void *partial, void *arg)
+{
+    if (partial != arg) {
+        release_batch_flush(partial);
+        free(partial);
+    }
+}
+
+void aatree_set_release_batch(Tree *tree, aatree_release_batch_f release_batch_cb)
+{
+    tree->release_batch_cb = release_batch_cb;
+}
+
+/*
+ * Background release
+ *
+ * Detached subtrees can be handed to a per-tree thread that walks
+ * and releases them, so writer does not pay for it.  Thread is
+ * started on first use and stopped by destroy after the queue
+ * is drained.
+ */
+
+struct ReaperJob {
+    struct ReaperJob *next;
+    Node *root;
+};
+
+struct AATreeReaper {
+    Tree *tree;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ReaperJob *jobs;
+    bool stop;
+};
+
+static void count_walker(Node *node, void *arg)
+{
+    (void)node;
+    (*(int *)arg)++;
+}
+
+/* release detached subtree, returns number of nodes in it */
+static int release_subtree(Tree *tree, Node *root)
+{
+    struct ReleaseBatch batch = { .tree = tree };
+    int count = 0;
+
+    /* fixed arena takes nodes back too */
+    if (tree->release_batch_cb || tree->release_cb || (tree->arena && tree->arena->capacity)) {
+        walk_sub(root, AA_WALK_POST_ORDER, release_batch_add, &batch);
+        release_batch_flush(&batch);
+        return batch.total;
+    }
+    walk_sub(root, AA_WALK_POST_ORDER, count_walker, &count);
+    return count;
+}
+
+static void *reaper_main(void *arg)
+{
+    struct AATreeReaper *reaper = arg;
+    struct ReaperJob *job, *next;
+
+    pthread_mutex_lock(&reaper->lock);
+    while (true) {
+        while (!reaper->jobs && !reaper->stop)
+            pthread_cond_wait(&reaper->cond, &reaper->lock);
+        job = reaper->jobs;
+        reaper->jobs = NULL;
+        if (!job && reaper->stop)
+            break;
+
+        pthread_mutex_unlock(&reaper->lock);
+        for (; job; job = next) {
+            next = job->next;
+            tree_count_add(reaper->tree, -release_subtree(reaper->tree, job->root));
+            free(job);
+        }
+        pthread_mutex_lock(&reaper->lock);
+    }
+    pthread_mutex_unlock(&reaper->lock);
+    return NULL;
+}
+
+static struct AATreeReaper *reaper_start(Tree *tree)
+{
+    struct AATreeReaper *reaper = malloc(sizeof(*reaper));
+
+    if (!reaper)
+        return NULL;
+    reaper->tree = tree;
+    reaper->jobs = NULL;
+    reaper->stop = false;
+    pthread_mutex_init(&reaper->lock, NULL);
+    pthread_cond_init(&reaper->cond, NULL);
+    if (pthread_create(&reaper->thread, NULL, reaper_main, reaper) != 0) {
+        pthread_cond_destroy(&reaper->cond);
+        pthread_mutex_destroy(&reaper->lock);
+        free(reaper);
+        return NULL;
+    }
+    return reaper;
+}
+
+/* queue subtree for background release, false if it must be done here */
+static bool reaper_queue(Tree *tree, Node *root)
+{
+    struct ReaperJob *job;
+
+    if (!tree->reaper)
+        tree->reaper = reaper_start(tree);
+    job = malloc(sizeof(*job));
+    if (!tree->reaper || !job) {
+        free(job);
+        return false;
+    }
+
+    job->root = root;
+    pthread_mutex_lock(&tree->reaper->lock);
+    job->next = tree->reaper->jobs;
+    tree->reaper->jobs = job;
+    pthread_cond_signal(&tree->reaper->cond);
+    pthread_mutex_unlock(&tree->reaper->lock);
+    return true;
+}
+
+static void reaper_stop(struct AATreeReaper *reaper)
+{
+    pthread_mutex_lock(&reaper->lock);
+    reaper->stop = true;
+    pthread_cond_signal(&reaper->cond);
+    pthread_mutex_unlock(&reaper->lock);
+
+    pthread_join(reaper->thread, NULL);
+    pthread_cond_destroy(&reaper->cond);
+    pthread_mutex_destroy(&reaper->lock);
+    free(reaper);
+}
+
+static void destroy_finish(Tree *tree)
+{
+    /* pending background releases may still need the arena */
+    if (tree->reaper) {
+        reaper_stop(tree->reaper);
+        tree->reaper = NULL;
+    }
+
+    /* arena nodes need no release, they go away with their chunks */
+    if (tree->arena) {
+        arena_free(tree->arena);
+        tree->arena = NULL;
+    }
+
+    /* reset tree */
+    tree->root = NIL;
+    tree_count_reset(tree);
+    aalock_destroy(&tree->lock);
+}
+
+/* walk tree in bottom-up order, so that walker can destroy the nodes */
+void aatree_destroy(Tree *tree)
+{
+    if (tree->release_batch_cb) {
+        struct ReleaseBatch batch = { .tree = tree };
+        walk_sub(tree->root, AA_WALK_POST_ORDER, release_batch_add, &batch);
+        release_batch_flush(&batch);
+    } else if (tree->release_cb) {
+        walk_sub(tree->root, AA_WALK_POST_ORDER, tree->release_cb, tree);
+    }
+
+    destroy_finish(tree);
+}
+
+/*
+ * Release subtrees on several threads.  Walking a chunk never touches
+ * nodes outside of it, so chunks can be released in any order.
+ */
+void aatree_destroy_parallel(Tree *tree, int nthreads)
+{
+    struct ReleaseBatch shared = { .tree = tree, .direct = true };
+
+    if (tree->release_batch_cb || tree->release_cb)
+        aatree_parallel_walk_reduce(tree, AA_WALK_POST_ORDER, release_batch_add,
+                                    release_batch_new, release_batch_done,
+                                    &shared, nthreads);
+
+    destroy_finish(tree);
+}
+
+/*
+ * Range removal
+ *
+ * Tree is split into three by key with join-based split, the middle
+ * part is detached in one piece and outer parts are joined back.
+ * Split and join cost O(log n), so removing k nodes costs
+ * O(log n + k) with the k part spent only on releasing them.
+ */
+
+static inline void link_left(Node *parent, Node *child)
+{
+    node_atomic_set_left(parent, child);
+    if (child != NIL)
+        node_atomic_set_parent(child, parent);
+}
+
+static inline void link_right(Node *parent, Node *child)
+{
+    node_atomic_set_right(parent, child);
+    if (child != NIL)
+        node_atomic_set_parent(child, parent);
+}
+
+/*
+ * Join two trees and a middle node, all keys in left < k < all keys
+ * in right.  Middle node goes down the spine of the higher tree to
+ * the level of the lower one, then skew/split fix the way back up.
+ */
+static Node *join_sub(Node *left, Node *k, Node *right)
+{
+    int left_level = node_atomic_get_level(left);
+    int right_level = node_atomic_get_level(right);
+
+    if (left_level == right_level) {
+        link_left(k, left);
+        link_right(k, right);
+        node_atomic_set_level(k, left_level + 1);
+        return k;
+    }
+
+    if (left_level > right_level) {
+        link_right(left, join_sub(node_atomic_get_right(left), k, right));
+        return split(skew(left));
+    }
+
+    link_left(right, join_sub(left, k, node_atomic_get_left(right)));
+    return split(skew(right));
+}
+
+static Node *join(Node *left, Node *k, Node *right)
+{
+    Node *root = join_sub(left, k, right);
+    node_atomic_set_parent(root, NIL);
+    return root;
+}
+
+/* join without middle node, smallest node of right tree is taken for it */
+static Node *join2(Node *left, Node *right)
+{
+    Node *k;
+
+    if (left == NIL)
+        return right;
+    if (right == NIL)
+        return left;
+
+    right = steal_leftmost(right, &k);
+    if (right != NIL)
+        node_atomic_set_parent(right, NIL);
+    return join(left, k, right);
+}
+
+/*
+ * Split tree by value.  Nodes below value go to left tree, equal
+ * ones too when inclusive, rest go to right tree.
+ */
+static void split_by_value(Tree *tree, Node *current, uintptr_t value, bool inclusive,
+                           Node **left_p, Node **right_p)
+{
+    Node *left, *right, *a, *b;
+    int cmp;
+
+    if (current == NIL) {
+        *left_p = *right_p = NIL;
+        return;
+    }
+
+    left = node_atomic_get_left(current);
+    right = node_atomic_get_right(current);
+    if (left != NIL)
+        node_atomic_set_parent(left, NIL);
+    if (right != NIL)
+        node_atomic_set_parent(right, NIL);
+
+    cmp = tree_cmp(tree, value, current);
+    if (cmp > 0 || (inclusive && cmp == 0)) {
+        split_by_value(tree, right, value, inclusive, &a, &b);
+        *left_p = join(left, current, a);
+        *right_p = b;
+    } else {
+        split_by_value(tree, left, value, inclusive, &a, &b);
+        *left_p = a;
+        *right_p = join(b, current, right);
+    }
+}
+
+static Node *detach_range(Tree *tree, uintptr_t lo, uintptr_t hi)
+{
+    Node *below, *rest, *range, *above;
+
+    split_by_value(tree, tree->root, lo, false, &below, &rest);
+    split_by_value(tree, rest, hi, true, &range, &above);
+    tree->root = join2(below, above);
+    return range;
+}
+
+/* remove nodes between lo and hi inclusive, returns number of nodes removed */
+int aatree_remove_range(Tree *tree, uintptr_t lo, uintptr_t hi)
+{
+    Node *range;
+    bool waited;
+    int count;
+
+    waited = tree_wrlock(tree);
+    range = detach_range(tree, lo, hi);
+    tree_adapt(tree, waited);
+    tree_wrunlock(tree);
+
+    /* detached nodes are not reachable anymore, release them unlocked */
+    count = release_subtree(tree, range);
+    tree_count_add(tree, -count);
+    return count;
+}
+
+/* remove nodes between lo and hi inclusive, release them on background thread */
+void aatree_remove_range_deferred(Tree *tree, uintptr_t lo, uintptr_t hi)
+{
+    Node *range;
+    bool queued, waited;
+
+    waited = tree_wrlock(tree);
+    range = detach_range(tree, lo, hi);
+    /* tree of one thread gets no background thread */
+    queued = (range == NIL)
+        || (!(tree->flags & AA_TREE_NO_LOCK) && reaper_queue(tree, range));
+    tree_adapt(tree, waited);
+    tree_wrunlock(tree);
+
+    if (!queued)
+        tree_count_add(tree, -release_subtree(tree, range));
+}
+
+static int tree_lock_flags(int flags)
+{
+    int lock_flags = 0;
+
+    if (flags & AA_TREE_LOCK_BRAVO)
+        lock_flags |= AA_LOCK_BRAVO;
+    if (flags & AA_TREE_LOCK_WRITER_PREF)
+        lock_flags |= AA_LOCK_WRITER_PREF;
+    if (flags & AA_TREE_LOCK_PHASE_FAIR)
+        lock_flags |= AA_LOCK_PHASE_FAIR;
+    if (flags & AA_TREE_LOCK_TASK_FAIR)
+        lock_flags |= AA_LOCK_TASK_FAIR;
+    if (flags & AA_TREE_NO_LOCK)
+        lock_flags |= AA_LOCK_NONE;
+    return lock_flags;
+}
+
+void aatree_get_stats(Tree *tree, uint64_t stats[AA_STAT_COUNT])
+{
+    for (int i = 0; i < AA_STAT_COUNT; i++)
+        stats[i] = atomic_load_explicit(&tree->stats[i], memory_order_relaxed);
+}
+
+/* prepare tree */
+void aatree_init_flags(Tree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags)
+{
+#ifdef AATREE_SINGLE_THREADED
+    flags |= AA_TREE_NO_LOCK;
+#endif
+    tree->root = NIL;
+    atomic_init(&tree->count, 0);
+    for (int i = 0; i < AATREE_COUNT_SHARDS; i++)
+        atomic_init(&tree->count_shards[i].delta, 0);
+    tree->node_cmp = cmpfn;
+    tree->release_cb = release_cb;
+    tree->release_batch_cb = NULL;
+    tree->arena = NULL;
+    tree->reaper = NULL;
+    tree->flags = flags;
+    tree->key_type = key_type_of(cmpfn);
+    for (int i = 0; i < AA_STAT_COUNT; i++)
+        atomic_init(&tree->stats[i], 0);
+    atomic_init(&tree->coarse, (flags & (AA_TREE_ADAPTIVE | AA_TREE_NO_LOCK | AA_TREE_COARSE)) != 0);
+    tree->adapt.ops = 0;
+    tree->adapt.waits = 0;
+    tree->adapt.fails = 0;
+    aalock_init(&tree->lock, tree_lock_flags(flags));
+}
+
+void aatree_init(Tree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb)
+{
+    aatree_init_flags(tree, cmpfn, release_cb, 0);
+}
+
+/*
+ * search function
+ */
+static inline Node *search_sub(Tree *tree, enum KeyType key_type, uintptr_t value)
+{
+    Node *current = atomic_load_explicit(&tree->root, memory_order_acquire);
+
+    /* Traverse tree */
+    while (current != NIL) {
+        int cmp = key_cmp(tree, key_type, value, current);
+        if (cmp > 0)
+            current = node_atomic_get_right(current);
+        else if (cmp < 0)
+            current = node_atomic_get_left(current);
+        else
+            return current;
+    }
+    return NULL;
+}
+
+Node *aatree_search(Tree *tree, uintptr_t value)
+{
+    Node *found;
+
+    /* Acquire read lock - allows concurrent readers */
+    tree_rdlock(tree);
+
+    /* one loop per built-in key type, each with compare inlined */
+    switch (tree->key_type) {
+    case KEY_I32: found = search_sub(tree, KEY_I32, value); break;
+    case KEY_U32: found = search_sub(tree, KEY_U32, value); break;
+    case KEY_I64: found = search_sub(tree, KEY_I64, value); break;
+    case KEY_U64: found = search_sub(tree, KEY_U64, value); break;
+    case KEY_PTR: found = search_sub(tree, KEY_PTR, value); break;
+    case KEY_STR: found = search_sub(tree, KEY_STR, value); break;
+    default: found = search_sub(tree, KEY_CUSTOM, value); break;
+    }
+
+    tree_rdunlock(tree);
+    return found;
+}
+
+/*
+ * Batched search.  Lookups of a group go down one level at a time in
+ * turn, next node of each is prefetched, so their cache misses
+ * overlap instead of following each other.
+ */
+#define SEARCH_GROUP 8
+
+static void search_group(Tree *tree, const uintptr_t *values, int count, Node **results)
+{
+    Node *root = atomic_load_explicit(&tree->root, memory_order_acquire);
+    Node *current[SEARCH_GROUP];
+    int active = (root != NIL) ? count : 0;
+    int cmp;
+
+    for (int i = 0; i < count; i++) {
+        current[i] = root;
+        results[i] = NULL;
+    }
+
+    while (active > 0) {
+        for (int i = 0; i < count; i++) {
+            if (current[i] == NIL)
+                continue;
+
+            cmp = tree_cmp(tree, values[i], current[i]);
+            if (cmp == 0) {
+                results[i] = current[i];
+                current[i] = NIL;
+            } else if (cmp > 0) {
+                current[i] = node_atomic_get_right(current[i]);
+            } else {
+                current[i] = node_atomic_get_left(current[i]);
+            }
+
+            if (current[i] == NIL)
+                active--;
+            else
+                prefetch(current[i]);
+        }
+    }
+}
+
+void aatree_search_batch(Tree *tree, const uintptr_t *values, int count, Node **results)
+{
+    tree_rdlock(tree);
+    for (int i = 0; i < count; i += SEARCH_GROUP) {
+        int n = (count - i < SEARCH_GROUP) ? count - i : SEARCH_GROUP;
+        search_group(tree, values + i, n, results + i);
+    }
+    tree_rdunlock(tree);
+}
+
+/*
+ * Bounded searches.  Descent remembers last node on each side
+ * of the value, those are the floor and ceiling candidates.
+ */
+static Node *bound_search(Tree *tree, uintptr_t value, Node **floor_p, Node **ceil_p)
+{
+    Node *current = atomic_load_explicit(&tree->root, memory_order_acquire);
+    Node *floor = NULL, *ceil = NULL;
+
+    while (current != NIL) {
+        int cmp = tree_cmp(tree, value, current);
+        if (cmp > 0) {
+            floor = current;
+            current = node_atomic_get_right(current);
+        } else if (cmp < 0) {
+            ceil = current;
+            current = node_atomic_get_left(current);
+        } else {
+            floor = ceil = current;
+            break;
+        }
+    }
+
+    *floor_p = floor;
+    *ceil_p = ceil;
+    return (current != NIL) ? current : NULL;
+}
+
+/* largest node not greater than value */
+Node *aatree_floor(Tree *tree, uintptr_t value)
+{
+    Node *floor, *ceil;
+
+    tree_rdlock(tree);
+    bound_search(tree, value, &floor, &ceil);
+    tree_rdunlock(tree);
+
+    return floor;
+}
+
+/* smallest node not less than value */
+Node *aatree_ceil(Tree *tree, uintptr_t value)
+{
+    Node *floor, *ceil;
+
+    tree_rdlock(tree);
+    bound_search(tree, value, &floor, &ceil);
+    tree_rdunlock(tree);
+
+    return ceil;
+}
+
+/* node closest to value by dist_cb, floor wins ties */
+Node *aatree_nearest(Tree *tree, uintptr_t value, aatree_dist_f dist_cb)
+{
+    Node *floor, *ceil, *found;
+
+    tree_rdlock(tree);
+    found = bound_search(tree, value, &floor, &ceil);
+    if (!found) {
+        if (!floor)
+            found = ceil;
+        else if (!ceil)
+            found = floor;
+        else
+            found = (dist_cb(value, ceil) < dist_cb(value, floor)) ? ceil : floor;
+    }
+    tree_rdunlock(tree);
+
+    return found;
+}
+
 /*
  * Print tree snapshot with state information (thread-safe)
  */
@@ -665,6 +2877,7 @@ static const char* state_to_string(enum AANodeState state)
         case Open: return "Open";
         case Insert: return "Insert";
         case Balancing: return "Balancing";
+        case BalancingWaited: return "BalancingWaited";
         default: return "Unknown";
     }
 }
@@ -711,7 +2924,7 @@ static void print_node_snapshot(Node *node, void (*value_printer)(Node *), int d
 
 void aatree_print_snapshot(struct AATree *tree, void (*value_printer)(struct AANode *))
 {
-    int count = atomic_load_explicit(&tree->count, memory_order_seq_cst);
+    int count = aatree_count(tree);
     int printed_nodes = 0;
 
     printf("\n=== AA-Tree Snapshot ===\n");
@@ -19,15 +19,24 @@
  * AA-Tree - Binary tree with embeddable nodes.
  *
  * AA-Tree (Arne Andersson tree) is a simplified Red-Black tree.
+ *
+ * Tree used by one thread only can be initialized with
+ * AA_TREE_NO_LOCK, its node links are then written with plain stores.
+ * Built with AATREE_SINGLE_THREADED defined, every tree is, no lock is
+ * ever called and node links are read and written with plain loads
+ * and stores.
  */
 
 #ifndef _USUAL_AATREE_H_
 #define _USUAL_AATREE_H_
 
 #include "base.h"
+#include "aalock.h"
 
 struct AATree;
 struct AANode;
+struct AATreeArena;
+struct AATreeReaper;
 
 #include <stdatomic.h>
 #include <pthread.h>
@@ -39,21 +48,93 @@ typedef int (*aatree_cmp_f)(uintptr_t, struct AANode *node);
 /** Callback for walking the tree */
 typedef void (*aatree_walker_f)(struct AANode *n, void *arg);
 
+/** Callback for distance between value and node */
+typedef uintptr_t (*aatree_dist_f)(uintptr_t value, struct AANode *node);
+
+/** Callback for checking node condition */
+typedef bool (*aatree_pred_f)(struct AANode *node, void *arg);
+
+/** Callback for releasing many nodes at once */
+typedef void (*aatree_release_batch_f)(struct AANode **nodes, int count, void *arg);
+
+/**
+ * Walk visitor result, tells walk how to continue.
+ */
+enum AATreeWalkResult {
+    AA_WALK_CONTINUE = 0,	/* go on with next node */
+    AA_WALK_STOP = 1,		/* end the walk */
+    AA_WALK_SKIP = 2,		/* do not enter subtrees not yet walked */
+};
+
+/** Callback for walking the tree with early exit */
+typedef enum AATreeWalkResult (*aatree_visitor_f)(struct AANode *n, void *arg);
+
+/** Callback for creating partial result of one parallel walk chunk */
+typedef void *(*aatree_partial_f)(void *arg);
+
+/** Callback for merging chunk partial result, called in walk order */
+typedef void (*aatree_reduce_f)(void *partial, void *arg);
+
+/**
+ * Contention statistics, see aatree_get_stats().
+ */
+enum AATreeStat {
+    AA_STAT_ACQUIRE_FAILS,	/* shared lock acquisitions that found a busy node */
+    AA_STAT_PARKS,		/* sleeps on a node held under the shared lock */
+    AA_STAT_WAIT_NS,		/* time spent waiting for those nodes */
+    AA_STAT_HELPS,		/* operations of other threads completed while waiting */
+    AA_STAT_INSERT_EXCLUSIVE,	/* inserts done under exclusive lock */
+    AA_STAT_INSERT_FALLBACKS,	/* of those, ones that lost to other threads under shared lock */
+    AA_STAT_INSERT_CONFLICTS,	/* shared lock insert attempts lost to other threads */
+    AA_STAT_MODE_SWITCHES,	/* AA_TREE_ADAPTIVE switches between coarse and fine */
+    AA_STAT_REMOVE_EXCLUSIVE,	/* single removes done under exclusive lock */
+    AA_STAT_COUNT
+};
+
+#define AATREE_LINE 64
+#define AATREE_COUNT_SHARDS 16
+
+/**
+ * Share of node count changed by some threads, one cache line each.
+ */
+struct AATreeCountShard {
+    _Alignas(AATREE_LINE) USUAL_AATREE_ATOMIC(int) delta;
+};
+
 /**
  * Tree header, for storing helper functions.
+ *
+ * Root and read-mostly fields, counters and lock are each on their
+ * own cache lines, so writers do not bounce the line searches read.
+ * The type is aligned to AATREE_LINE, above what malloc() guarantees,
+ * so heap copies must come from aligned_alloc(AATREE_LINE, ...) or be
+ * embedded in a struct allocated that way.
  */
 struct AATree {
-    USUAL_AATREE_ATOMIC(struct AANode *) root;
-    USUAL_AATREE_ATOMIC(int) count;
+    _Alignas(AATREE_LINE) USUAL_AATREE_ATOMIC(struct AANode *) root;
     aatree_cmp_f node_cmp;
     aatree_walker_f release_cb;
-    pthread_rwlock_t rw_lock;  /* RW lock: shared reads, exclusive writes */
+    aatree_release_batch_f release_batch_cb;
+    struct AATreeArena *arena;  /* tree-owned node memory, if any */
+    struct AATreeReaper *reaper;  /* background release thread, if started */
+    int flags;  /* enum AATreeFlags */
+    int key_type;  /* built-in compare recognized at init, if any */
+    _Alignas(AATREE_LINE) USUAL_AATREE_ATOMIC(int) count;  /* shares fold into it, approximate */
+    struct AATreeCountShard count_shards[AATREE_COUNT_SHARDS];
+    USUAL_AATREE_ATOMIC(uint64_t) stats[AA_STAT_COUNT];  /* enum AATreeStat counters */
+    USUAL_AATREE_ATOMIC(int) coarse;  /* all changes under exclusive lock, no node states */
+    struct {
+        int ops, waits;
+        uint64_t fails;
+    } adapt;  /* AA_TREE_ADAPTIVE window, changed under exclusive lock */
+    _Alignas(AATREE_LINE) struct AALock lock;  /* RW lock: shared reads, exclusive writes */
 };
 
 enum AANodeState {
     Open,  /** Everyone free to visit node */
     Insert, /** Only reading allowed */
-    Balancing  /** No one allowed to visit */
+    Balancing,  /** No one allowed to visit */
+    BalancingWaited  /** Balancing, and someone sleeps until it is over */
 };
 
 /**
@@ -70,7 +151,28 @@ struct AANode {
     USUAL_AATREE_ATOMIC(struct AANode *) right;	/**<  larger values */
     USUAL_AATREE_ATOMIC(struct AANode *) parent;
     USUAL_AATREE_ATOMIC(int) level;			/**<  number of black nodes to leaf */
-    USUAL_AATREE_ATOMIC(enum AANodeState) state;
+    USUAL_AATREE_ATOMIC(int) state;			/**<  enum AANodeState, owner tag above */
+};
+
+/**
+ * Tree flags for aatree_init_flags().
+ *
+ * With AA_TREE_DUPLICATES, aatree_remove(), aatree_remove_if(),
+ * aatree_upsert() and aatree_insert_or_get() act on the first of equal
+ * nodes in insertion order; aatree_search() may return any of them.
+ */
+enum AATreeFlags {
+    AA_TREE_DUPLICATES = 1 << 0,	/* insert links nodes with equal values, in insertion order */
+    AA_TREE_LOCK_BRAVO = 1 << 1,	/* readers avoid shared lock line while there are no writers */
+
+    /* tree lock policy, at most one, default prefers readers */
+    AA_TREE_LOCK_WRITER_PREF = 1 << 2,	/* waiting writer blocks new readers */
+    AA_TREE_LOCK_PHASE_FAIR = 1 << 3,	/* reader and writer phases alternate */
+    AA_TREE_LOCK_TASK_FAIR = 1 << 4,	/* strict arrival order */
+
+    AA_TREE_ADAPTIVE = 1 << 5,	/* start coarse, go fine-grained while writers contend */
+    AA_TREE_NO_LOCK = 1 << 6,	/* used by one thread only: no locks, node states or atomic adds */
+    AA_TREE_COARSE = 1 << 7,	/* all changes under exclusive lock, never wait on single nodes */
 };
 
 /**
@@ -82,21 +184,197 @@ enum AATreeWalkType {
     AA_WALK_POST_ORDER = 2,	/* left->right->self */
 };
 
+/**
+ * Key stored right after the embedded node,
+ * e.g. struct { struct AANode node; int64_t key; }.
+ */
+#define AATREE_NODE_KEY(node, type) \
+    (*(type *)((char *)(node) + CUSTOM_ALIGN(sizeof(struct AANode), alignof(type))))
+
+/**
+ * Built-in comparators for keys stored with AATREE_NODE_KEY(),
+ * value is the key itself.  Tree recognizes them and searches
+ * without indirect calls.  64-bit keys need 64-bit uintptr_t.
+ */
+int aatree_cmp_i32(uintptr_t value, struct AANode *node);
+int aatree_cmp_u32(uintptr_t value, struct AANode *node);
+int aatree_cmp_i64(uintptr_t value, struct AANode *node);
+int aatree_cmp_u64(uintptr_t value, struct AANode *node);
+int aatree_cmp_ptr(uintptr_t value, struct AANode *node);
+
+/**
+ * String or binary key.  First 8 bytes are kept as big-endian
+ * integer, so most compares need no access to key data.
+ */
+struct AAStrKey {
+    uint64_t prefix;
+    const void *data;
+    size_t len;
+};
+
+/** Tree node with string key, key data must stay valid while in tree */
+struct AAStrNode {
+    struct AANode node;
+    struct AAStrKey key;
+};
+
+/** Prepare string key, for node or for search value */
+void aatree_str_key_init(struct AAStrKey *key, const void *data, size_t len);
+
+/**
+ * Built-in comparator for struct AAStrNode, value is pointer to
+ * struct AAStrKey.  Keys are ordered as memcmp() does, shorter first.
+ */
+int aatree_cmp_str(uintptr_t value, struct AANode *node);
+
 /** Initialize structure */
 void aatree_init(struct AATree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb);
 
+/** Initialize structure with AATreeFlags */
+void aatree_init_flags(struct AATree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags);
+
 /** Search for node */
 struct AANode *aatree_search(struct AATree *tree, uintptr_t value);
 
+/** Search for many values under one lock, descents interleaved to overlap cache misses */
+void aatree_search_batch(struct AATree *tree, const uintptr_t *values, int count,
+                         struct AANode **results);
+
+/** Search for largest node not greater than value */
+struct AANode *aatree_floor(struct AATree *tree, uintptr_t value);
+
+/** Search for smallest node not less than value */
+struct AANode *aatree_ceil(struct AATree *tree, uintptr_t value);
+
+/** Search for node nearest to value, floor wins ties */
+struct AANode *aatree_nearest(struct AATree *tree, uintptr_t value, aatree_dist_f dist_cb);
+
 /** Insert new node */
 void aatree_insert(struct AATree *tree, uintptr_t value, struct AANode *node);
 
+/** Insert new node, unless value exists.  Returns node that is in tree. */
+struct AANode *aatree_insert_or_get(struct AATree *tree, uintptr_t value, struct AANode *node);
+
+/** Insert new node, replacing existing one.  Returns replaced node or NULL. */
+struct AANode *aatree_upsert(struct AATree *tree, uintptr_t value, struct AANode *node);
+
+/** Remove node */
+void aatree_remove(struct AATree *tree, uintptr_t value);
+
+/** Remove node only if pred returns true for it, returns true if removed */
+bool aatree_remove_if(struct AATree *tree, uintptr_t value, aatree_pred_f pred, void *arg);
+
+/**
+ * Replace old node with new one, returns false if old is not in tree.
+ * Links change under the shared lock, next to searches and other
+ * replaces.  Before returning replace waits for a grace period: for
+ * all shared lock holders that may still see old to let go.  Readers
+ * only count themselves in a per-thread slot for that, the tree lock
+ * is not taken exclusively.  Must not be called with a shared lock
+ * held, same as aatree_remove() and aatree_remove_if().
+ */
+bool aatree_replace(struct AATree *tree, struct AANode *old, struct AANode *node);
+
+/** Remove nodes between lo and hi inclusive, returns number of removed nodes */
+int aatree_remove_range(struct AATree *tree, uintptr_t lo, uintptr_t hi);
+
+/** Remove nodes between lo and hi inclusive, release them on background thread */
+void aatree_remove_range_deferred(struct AATree *tree, uintptr_t lo, uintptr_t hi);
+
 /** Walk over all nodes */
 void aatree_walk(struct AATree *tree, enum AATreeWalkType wtype, aatree_walker_f walker, void *arg);
 
+/**
+ * Walk over nodes until visitor returns AA_WALK_STOP.
+ *
+ * AA_WALK_SKIP skips both subtrees in pre-order, right subtree
+ * in in-order and has no effect in post-order.
+ * Returns true if walk was stopped by visitor.
+ */
+bool aatree_walk_until(struct AATree *tree, enum AATreeWalkType wtype, aatree_visitor_f visitor, void *arg);
+
+/**
+ * Walk in order from first node not less than value, returns true if stopped.
+ * Runs under tree read lock, visitor may search the tree only with
+ * default lock policy, with or without BRAVO.
+ */
+bool aatree_walk_from(struct AATree *tree, uintptr_t value, aatree_visitor_f visitor, void *arg);
+
+/** Walk over nodes equal to value in insertion order, returns their number */
+int aatree_walk_equal(struct AATree *tree, uintptr_t value, aatree_walker_f walker, void *arg);
+
+/** Count nodes equal to value */
+int aatree_count_equal(struct AATree *tree, uintptr_t value);
+
+/** Walk over all nodes in order using several threads, walker must be thread-safe */
+void aatree_parallel_walk(struct AATree *tree, aatree_walker_f walker, void *arg, int nthreads);
+
+/**
+ * Walk over all nodes using several threads.
+ *
+ * Walker gets partial result of its chunk as arg, partials are
+ * merged into arg and released by reduce_cb in walk order.
+ * NULL partial_cb passes arg to walker directly.
+ */
+void aatree_parallel_walk_reduce(struct AATree *tree, enum AATreeWalkType wtype,
+                                 aatree_walker_f walker, aatree_partial_f partial_cb,
+                                 aatree_reduce_f reduce_cb, void *arg, int nthreads);
+
+/** Release nodes in batches, instead of one release_cb call per node */
+void aatree_set_release_batch(struct AATree *tree, aatree_release_batch_f release_batch_cb);
+
+/**
+ * Let tree own node memory.  Nodes are node_size bytes each and
+ * are freed all at once by destroy, release callbacks are only
+ * needed for other cleanup.  Returns false on allocation failure.
+ */
+bool aatree_arena_init(struct AATree *tree, size_t node_size);
+
+/**
+ * Same as aatree_arena_init(), but node memory is kept per NUMA
+ * node and taken from the one local to the allocating thread.
+ */
+bool aatree_arena_init_numa(struct AATree *tree, size_t node_size);
+
+/** Allocate memory for one node from tree arena, NULL when fixed arena is full */
+void *aatree_arena_alloc(struct AATree *tree);
+
+/**
+ * Give back arena memory of a node that is not in tree: one rejected
+ * as duplicate by aatree_insert_or_get(), or returned by
+ * aatree_upsert() or replaced by aatree_replace().  Fixed arena reuses
+ * it, growing arena keeps it until destroy.  Nodes removed from tree
+ * are given back by the tree itself.
+ */
+void aatree_arena_free(struct AATree *tree, void *mem);
+
+/**
+ * Initialize tree with fixed arena of capacity nodes, node_size bytes
+ * each, all allocated and touched here.  aatree_arena_alloc() then
+ * never mallocs, nodes removed from tree are reused.  Tree is
+ * AA_TREE_COARSE, so insert and remove take time bounded by tree
+ * height once they hold the lock; with AA_TREE_LOCK_PHASE_FAIR a
+ * writer waits for at most one reader phase, with AA_TREE_NO_LOCK
+ * not at all.  Returns false on allocation failure.
+ */
+bool aatree_init_fixed(struct AATree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb, int flags,
+                       size_t node_size, size_t capacity);
+
+/** Number of nodes, exact while no change is running */
+int aatree_count(struct AATree *tree);
+
+/** Number of nodes without summing the shares, off by a few per writing thread */
+int aatree_count_approx(struct AATree *tree);
+
+/** Copy contention counters, indexed by enum AATreeStat */
+void aatree_get_stats(struct AATree *tree, uint64_t stats[AA_STAT_COUNT]);
+
 /** Free */
 void aatree_destroy(struct AATree *tree);
 
+/** Free, releasing subtrees on several threads */
+void aatree_destroy_parallel(struct AATree *tree, int nthreads);
+
 
 void aatree_print_snapshot(struct AATree *tree, void (*value_printer)(struct AANode *));
 
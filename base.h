@@ -275,6 +275,22 @@ typedef enum { true=1, false=0 } bool;
 #define unlikely(x) (x)
 #endif
 
+/** Hint for CPU to start loading memory at (addr) into cache */
+#if _COMPILER_GNUC(4,0) || __has_builtin(__builtin_prefetch)
+#define prefetch(addr) __builtin_prefetch(addr)
+#else
+#define prefetch(addr) ((void)(addr))
+#endif
+
+/** Hint for CPU that this is a spin-wait loop */
+#if (defined(__x86_64__) || defined(__i386__)) && (_COMPILER_GNUC(4,0) || defined(__clang__))
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) && (_COMPILER_GNUC(4,0) || defined(__clang__))
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
 /* @} */
 
 
@@ -0,0 +1,256 @@
+/*
+ * Tree lock policy benchmark.
+ *
+ * Reader threads search the tree in a loop, one writer inserts and
+ * removes a key with a short pause between operations.  For each
+ * lock policy prints read throughput and latency of write calls,
+ * which includes the time writer waits for the lock.
+ *
+ * Then one thread alone removes random keys from a full tree and
+ * inserts them again, with malloc'd nodes and with fixed arena tree.
+ * Latency includes node allocation.  The claimed bound for fixed tree
+ * is on work done by the calling thread: each operation walks at most
+ * tree height nodes and never enters malloc or faults in new memory.
+ * So besides wall clock, which also counts time the thread was
+ * preempted, the run measures thread CPU time of each operation; its
+ * tail is the figure the bound applies to.  CPU time still counts
+ * interrupts taken while the thread runs and, in a virtual machine,
+ * host steal time, so its max is noise there too.
+ *
+ * Usage: aatree_bench [readers] [seconds per policy]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "aatree.h"
+
+#define TREE_SIZE 100000
+#define MAX_SAMPLES 1000000
+#define WRITE_PAUSE_US 100
+
+typedef struct BenchNode BenchNode;
+struct BenchNode {
+    struct AANode node;
+    int32_t key;
+};
+
+struct Bench {
+    struct AATree tree;
+    _Atomic(int) stop;
+    _Atomic(uint64_t) reads;
+    uint64_t *samples;
+    int nsamples;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_node_free(struct AANode *node, void *arg)
+{
+    free(container_of(node, BenchNode, node));
+}
+
+static BenchNode *bench_node(int32_t key)
+{
+    BenchNode *bn = malloc(sizeof(*bn));
+    memset(bn, 0, sizeof(*bn));
+    bn->key = key;
+    return bn;
+}
+
+static void *reader_main(void *arg)
+{
+    struct Bench *b = arg;
+    unsigned seed = (unsigned)(uintptr_t)&seed;
+    uint64_t reads = 0;
+
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        aatree_search(&b->tree, rand_r(&seed) % TREE_SIZE);
+        reads++;
+    }
+    atomic_fetch_add(&b->reads, reads);
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    struct Bench *b = arg;
+    uint64_t start;
+    int32_t key = TREE_SIZE;
+
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed) && b->nsamples < MAX_SAMPLES - 1) {
+        BenchNode *bn = bench_node(key);
+
+        start = now_ns();
+        aatree_insert(&b->tree, key, &bn->node);
+        b->samples[b->nsamples++] = now_ns() - start;
+
+        start = now_ns();
+        aatree_remove(&b->tree, key);
+        b->samples[b->nsamples++] = now_ns() - start;
+
+        key++;
+        usleep(WRITE_PAUSE_US);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int n, double p)
+{
+    int i = (int)(p * (n - 1));
+    return n ? sorted[i] : 0;
+}
+
+static void run(const char *name, int flags, int nreaders, int seconds)
+{
+    struct Bench b;
+    pthread_t readers[nreaders], writer;
+    uint64_t start, elapsed;
+
+    aatree_init_flags(&b.tree, aatree_cmp_i32, bench_node_free, flags);
+    for (int32_t i = 0; i < TREE_SIZE; i++) {
+        BenchNode *bn = bench_node(i);
+        aatree_insert(&b.tree, i, &bn->node);
+    }
+    atomic_init(&b.stop, 0);
+    atomic_init(&b.reads, 0);
+    b.samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    b.nsamples = 0;
+
+    start = now_ns();
+    for (int i = 0; i < nreaders; i++)
+        pthread_create(&readers[i], NULL, reader_main, &b);
+    pthread_create(&writer, NULL, writer_main, &b);
+    sleep(seconds);
+    atomic_store(&b.stop, 1);
+    for (int i = 0; i < nreaders; i++)
+        pthread_join(readers[i], NULL);
+    pthread_join(writer, NULL);
+    elapsed = now_ns() - start;
+
+    qsort(b.samples, b.nsamples, sizeof(uint64_t), cmp_u64);
+    printf("%-18s %10.0f %8d %9.1f %9.1f %9.1f %9.1f\n", name,
+           atomic_load(&b.reads) * 1e9 / elapsed, b.nsamples,
+           percentile(b.samples, b.nsamples, 0.5) / 1e3,
+           percentile(b.samples, b.nsamples, 0.99) / 1e3,
+           percentile(b.samples, b.nsamples, 0.999) / 1e3,
+           b.nsamples ? b.samples[b.nsamples - 1] / 1e3 : 0.0);
+
+    free(b.samples);
+    aatree_destroy(&b.tree);
+}
+
+static void run_latency(const char *name, bool fixed, int seconds)
+{
+    struct AATree tree;
+    uint64_t *samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    uint64_t *cpu_samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    uint64_t start, cpu_start, end;
+    unsigned seed = 1;
+    int nsamples = 0;
+    BenchNode *bn;
+
+    if (!samples || !cpu_samples) {
+        printf("%-18s out of memory\n", name);
+        goto out;
+    }
+    if (fixed) {
+        if (!aatree_init_fixed(&tree, aatree_cmp_i32, NULL, 0, sizeof(BenchNode), TREE_SIZE)) {
+            printf("%-18s aatree_init_fixed failed\n", name);
+            goto out;
+        }
+    } else {
+        aatree_init(&tree, aatree_cmp_i32, bench_node_free);
+    }
+    for (int32_t i = 0; i < TREE_SIZE; i++) {
+        bn = fixed ? aatree_arena_alloc(&tree) : bench_node(i);
+        if (!bn) {
+            printf("%-18s node allocation failed\n", name);
+            goto destroy;
+        }
+        bn->key = i;
+        aatree_insert(&tree, i, &bn->node);
+    }
+
+    end = now_ns() + (uint64_t)seconds * 1000000000;
+    while (now_ns() < end && nsamples < MAX_SAMPLES - 1) {
+        int32_t key = rand_r(&seed) % TREE_SIZE;
+
+        start = now_ns();
+        cpu_start = cpu_ns();
+        aatree_remove(&tree, key);
+        cpu_samples[nsamples] = cpu_ns() - cpu_start;
+        samples[nsamples++] = now_ns() - start;
+
+        start = now_ns();
+        cpu_start = cpu_ns();
+        bn = fixed ? aatree_arena_alloc(&tree) : bench_node(key);
+        if (!bn) {
+            printf("%-18s node allocation failed\n", name);
+            goto destroy;
+        }
+        bn->key = key;
+        aatree_insert(&tree, key, &bn->node);
+        cpu_samples[nsamples] = cpu_ns() - cpu_start;
+        samples[nsamples++] = now_ns() - start;
+    }
+
+    qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+    qsort(cpu_samples, nsamples, sizeof(uint64_t), cmp_u64);
+    printf("%-18s %8d %9.1f %9.1f %9.1f %10.1f %9.1f\n", name, nsamples,
+           percentile(samples, nsamples, 0.5) / 1e3,
+           percentile(samples, nsamples, 0.99) / 1e3,
+           nsamples ? samples[nsamples - 1] / 1e3 : 0.0,
+           percentile(cpu_samples, nsamples, 0.9999) / 1e3,
+           nsamples ? cpu_samples[nsamples - 1] / 1e3 : 0.0);
+
+destroy:
+    aatree_destroy(&tree);
+out:
+    free(samples);
+    free(cpu_samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int nreaders = (argc > 1) ? atoi(argv[1]) : 4;
+    int seconds = (argc > 2) ? atoi(argv[2]) : 1;
+
+    printf("%d readers, 1 writer, %d s per policy, write latency in us\n", nreaders, seconds);
+    printf("%-18s %10s %8s %9s %9s %9s %9s\n", "policy", "reads/s", "writes",
+           "p50", "p99", "p99.9", "max");
+    run("default", 0, nreaders, seconds);
+    run("writer-pref", AA_TREE_LOCK_WRITER_PREF, nreaders, seconds);
+    run("phase-fair", AA_TREE_LOCK_PHASE_FAIR, nreaders, seconds);
+    run("task-fair", AA_TREE_LOCK_TASK_FAIR, nreaders, seconds);
+    run("bravo", AA_TREE_LOCK_BRAVO, nreaders, seconds);
+    run("bravo+phase-fair", AA_TREE_LOCK_BRAVO | AA_TREE_LOCK_PHASE_FAIR, nreaders, seconds);
+
+    printf("\n1 thread, remove and insert of random key, latency in us\n");
+    printf("wall clock includes preemption, bound applies to thread cpu time\n");
+    printf("%-18s %8s %9s %9s %9s %10s %9s\n", "tree", "writes", "p50", "p99", "max",
+           "cpu p99.99", "cpu max");
+    run_latency("malloc", false, seconds);
+    run_latency("fixed", true, seconds);
+    return 0;
+}
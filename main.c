@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include "aatree.h"
+#include "aadeleg.h"
+#include "aaasync.h"
 
 #define NUM_THREADS 4
 #define NODES_PER_THREAD 100
@@ -24,7 +27,8 @@ static void my_node_free(struct AANode *node, void *arg)
 static int my_node_cmp(uintptr_t value, struct AANode *node)
 {
     MyNode *my = container_of(node, MyNode, node);
-    return value - my->value;
+    int v = value;
+    return (v > my->value) - (v < my->value);
 }
 
 static const char * my_search(struct AATree *tree, int value)
@@ -53,7 +57,7 @@ static int my_node_pair_cmp(const struct AANode *n1, const struct AANode *n2)
 {
     const struct MyNode *m1 = container_of(n1, struct MyNode, node);
     const struct MyNode *m2 = container_of(n2, struct MyNode, node);
-    return m1->value - m2->value;
+    return (m1->value > m2->value) - (m1->value < m2->value);
 }
 
 static const char *check_sub(const struct AATree *tree, const struct AANode *node, int i)
@@ -90,7 +94,8 @@ static const char *check(struct AATree *tree, int i)
 static const char *my_insert(struct AATree *tree, int value)
 {
     MyNode *my = make_node(value);
-    aatree_insert(tree, value, &my->node);
+    if (aatree_insert_or_get(tree, value, &my->node) != &my->node)
+        free(my);
     return check(tree, value);
 }
 
@@ -298,6 +303,1488 @@ static void test_read_concurrent_insert() {
     aatree_destroy(tree);
 }
 
+typedef struct {
+    int count;
+    int first;
+    int last;
+    bool sorted;
+} WalkCheckArg;
+
+static void walk_check_func(struct AANode *node, void *arg)
+{
+    WalkCheckArg *wc = arg;
+    MyNode *my = container_of(node, MyNode, node);
+    if (wc->count == 0)
+        wc->first = my->value;
+    else if (my->value <= wc->last)
+        wc->sorted = false;
+    wc->last = my->value;
+    wc->count++;
+}
+
+static void *walk_check_partial(void *arg)
+{
+    WalkCheckArg *wc = malloc(sizeof(*wc));
+    memset(wc, 0, sizeof(*wc));
+    wc->sorted = true;
+    return wc;
+}
+
+static void walk_check_reduce(void *partial, void *arg)
+{
+    WalkCheckArg *part = partial;
+    WalkCheckArg *wc = arg;
+    if (part->count > 0) {
+        if (!part->sorted || (wc->count > 0 && part->first <= wc->last))
+            wc->sorted = false;
+        if (wc->count == 0)
+            wc->first = part->first;
+        wc->last = part->last;
+        wc->count += part->count;
+    }
+    free(part);
+}
+
+typedef struct {
+    int count;
+    int max;
+    struct AANode **nodes;
+} WalkSeqArg;
+
+static void walk_seq_func(struct AANode *node, void *arg)
+{
+    WalkSeqArg *ws = arg;
+    if (ws->count < ws->max)
+        ws->nodes[ws->count] = node;
+    ws->count++;
+}
+
+// recursive reference walk
+static void walk_ref(struct AANode *node, enum AATreeWalkType wtype, WalkSeqArg *ws)
+{
+    if (aatree_is_nil_node(node))
+        return;
+    if (wtype == AA_WALK_PRE_ORDER)
+        walk_seq_func(node, ws);
+    walk_ref(node->left, wtype, ws);
+    if (wtype == AA_WALK_IN_ORDER)
+        walk_seq_func(node, ws);
+    walk_ref(node->right, wtype, ws);
+    if (wtype == AA_WALK_POST_ORDER)
+        walk_seq_func(node, ws);
+}
+
+// walk visits nodes in the same sequence as recursive reference
+static bool walk_matches_ref(struct AATree *tree, enum AATreeWalkType wtype, int total)
+{
+    struct AANode **got = malloc(total * sizeof(struct AANode *));
+    struct AANode **want = malloc(total * sizeof(struct AANode *));
+    WalkSeqArg got_arg = { 0, total, got };
+    WalkSeqArg want_arg = { 0, total, want };
+    bool ok;
+
+    aatree_walk(tree, wtype, walk_seq_func, &got_arg);
+    walk_ref(tree->root, wtype, &want_arg);
+    ok = got_arg.count == total && want_arg.count == total
+        && memcmp(got, want, total * sizeof(struct AANode *)) == 0;
+
+    free(got);
+    free(want);
+    return ok;
+}
+
+// iterative walks visit every node in the order of recursive ones, in-order walk is sorted
+static void test_walk_order() {
+    struct AATree tree[1];
+    WalkCheckArg in_order = { 0, 0, 0, true };
+    WalkCheckArg pre_order = { 0, 0, 0, true };
+    WalkCheckArg post_order = { 0, 0, 0, true };
+    int total = NUM_THREADS * NODES_PER_THREAD;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+
+    // scattered insertion order
+    for (int i = 0; i < total; i++) {
+        int value = (i * 37) % total;
+        MyNode *my = make_node(value);
+        aatree_insert(tree, value, &my->node);
+    }
+
+    aatree_walk(tree, AA_WALK_IN_ORDER, walk_check_func, &in_order);
+    aatree_walk(tree, AA_WALK_PRE_ORDER, walk_check_func, &pre_order);
+    aatree_walk(tree, AA_WALK_POST_ORDER, walk_check_func, &post_order);
+
+    printf("test_walk_order: in=%d pre=%d post=%d of %d nodes\n",
+           in_order.count, pre_order.count, post_order.count, total);
+    if (in_order.count == total && in_order.sorted
+        && pre_order.count == total && post_order.count == total
+        && walk_matches_ref(tree, AA_WALK_IN_ORDER, total)
+        && walk_matches_ref(tree, AA_WALK_PRE_ORDER, total)
+        && walk_matches_ref(tree, AA_WALK_POST_ORDER, total)) {
+        printf("test_walk_order: PASSED\n");
+    } else {
+        printf("test_walk_order: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+// chunks of parallel walk are reduced in key order
+static void test_parallel_walk() {
+    struct AATree tree[1];
+    WalkCheckArg in_order = { 0, 0, 0, true };
+    int total = NUM_THREADS * NODES_PER_THREAD;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+
+    for (int i = 0; i < total; i++) {
+        int value = (i * 37) % total;
+        MyNode *my = make_node(value);
+        aatree_insert(tree, value, &my->node);
+    }
+
+    aatree_parallel_walk_reduce(tree, AA_WALK_IN_ORDER, walk_check_func,
+                                walk_check_partial, walk_check_reduce,
+                                &in_order, NUM_THREADS);
+
+    printf("test_parallel_walk: %d/%d nodes walked\n", in_order.count, total);
+    if (in_order.count == total && in_order.sorted) {
+        printf("test_parallel_walk: PASSED\n");
+    } else {
+        printf("test_parallel_walk: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+typedef struct {
+    int limit;
+    int count;
+    int values[8];
+} WalkLimitArg;
+
+static enum AATreeWalkResult walk_limit_func(struct AANode *node, void *arg)
+{
+    WalkLimitArg *wl = arg;
+    MyNode *my = container_of(node, MyNode, node);
+    wl->values[wl->count++] = my->value;
+    return (wl->count < wl->limit) ? AA_WALK_CONTINUE : AA_WALK_STOP;
+}
+
+static enum AATreeWalkResult walk_skip_func(struct AANode *node, void *arg)
+{
+    (*(int *)arg)++;
+    return AA_WALK_SKIP;
+}
+
+// bounded walks stop early and start from given key
+static void test_walk_early_exit() {
+    struct AATree tree[1];
+    WalkLimitArg first = { .limit = 3 };
+    WalkLimitArg from = { .limit = 5 };
+    int skipped = 0;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+
+    for (int i = 0; i < 200; i += 2) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    ok = ok && aatree_walk_until(tree, AA_WALK_IN_ORDER, walk_limit_func, &first);
+    ok = ok && first.count == 3 && first.values[0] == 0 && first.values[2] == 4;
+
+    ok = ok && aatree_walk_from(tree, 101, walk_limit_func, &from);
+    ok = ok && from.count == 5 && from.values[0] == 102 && from.values[4] == 110;
+
+    // skipping in pre-order visits the root only
+    ok = ok && !aatree_walk_until(tree, AA_WALK_PRE_ORDER, walk_skip_func, &skipped);
+    ok = ok && skipped == 1;
+
+    if (ok) {
+        printf("test_walk_early_exit: PASSED\n");
+    } else {
+        printf("test_walk_early_exit: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+static atomic_int released_count;
+
+static void my_node_free_batch(struct AANode **nodes, int count, void *arg)
+{
+    for (int i = 0; i < count; i++)
+        free(container_of(nodes[i], MyNode, node));
+    atomic_fetch_add(&released_count, count);
+}
+
+// batched parallel teardown releases every node, arena needs no release;
+// removed nodes go to the batch callback too
+static void test_destroy_parallel() {
+    struct AATree tree[1];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    bool ok;
+
+    aatree_init(tree, my_node_cmp, NULL);
+    aatree_set_release_batch(tree, my_node_free_batch);
+    for (int i = 0; i < total; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+    released_count = 0;
+    for (int i = 0; i < 10; i++)
+        aatree_remove(tree, i);
+    for (int i = 10; i < 20; i++)
+        aatree_remove_if(tree, i, NULL, NULL);
+    ok = released_count == 20;
+    aatree_destroy_parallel(tree, NUM_THREADS);
+    ok = ok && released_count == total;
+
+    aatree_init(tree, my_node_cmp, NULL);
+    ok = ok && aatree_arena_init(tree, sizeof(MyNode));
+    for (int i = 0; ok && i < total; i++) {
+        MyNode *my = aatree_arena_alloc(tree);
+        memset(my, 0, sizeof(*my));
+        my->value = i;
+        aatree_insert(tree, i, &my->node);
+    }
+    ok = ok && aatree_search(tree, total - 1) != NULL;
+    aatree_destroy(tree);
+
+    printf("test_destroy_parallel: %d/%d nodes released\n", released_count, total);
+    if (ok) {
+        printf("test_destroy_parallel: PASSED\n");
+    } else {
+        printf("test_destroy_parallel: FAILED\n");
+    }
+}
+
+// range removal keeps tree valid and drops exactly the range
+static void test_remove_range() {
+    struct AATree tree[1];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    int removed, deferred_left;
+    const char *check_result;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < total; i++) {
+        int value = (i * 37) % total;
+        MyNode *my = make_node(value);
+        aatree_insert(tree, value, &my->node);
+    }
+
+    removed = aatree_remove_range(tree, 100, 199);
+    check_result = check(tree, 0);
+    for (int i = 0; i < total; i++) {
+        bool in_range = i >= 100 && i <= 199;
+        if ((aatree_search(tree, i) != NULL) == in_range)
+            ok = false;
+    }
+
+    aatree_remove_range_deferred(tree, 0, 49);
+    deferred_left = 0;
+    for (int i = 0; i < 100; i++) {
+        if (aatree_search(tree, i) != NULL)
+            deferred_left++;
+    }
+
+    printf("test_remove_range: removed %d, tree structure %s\n", removed, check_result);
+    if (ok && removed == 100 && strcmp(check_result, "OK") == 0 && deferred_left == 50) {
+        printf("test_remove_range: PASSED\n");
+    } else {
+        printf("test_remove_range: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+// insert_or_get keeps existing node, upsert swaps it in place
+static void test_upsert() {
+    struct AATree tree[1];
+    MyNode *first, *second, *third;
+    struct AANode *res;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < 50; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    first = make_node(100);
+    second = make_node(100);
+    third = make_node(100);
+
+    ok = ok && aatree_insert_or_get(tree, 100, &first->node) == &first->node;
+    ok = ok && aatree_insert_or_get(tree, 100, &second->node) == &first->node;
+    ok = ok && aatree_upsert(tree, 100, &third->node) == &first->node;
+    ok = ok && aatree_search(tree, 100) == &third->node;
+    second->value = 25;
+    res = aatree_upsert(tree, 25, &second->node);
+    ok = ok && res != NULL;
+    if (res)
+        my_node_free(res, NULL);
+    ok = ok && aatree_search(tree, 25) == &second->node;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && aatree_count(tree) == 51;
+
+    if (ok) {
+        printf("test_upsert: PASSED\n");
+    } else {
+        printf("test_upsert: FAILED\n");
+    }
+
+    free(first);
+    aatree_destroy(tree);
+}
+
+static bool my_node_is_odd(struct AANode *node, void *arg)
+{
+    MyNode *my = container_of(node, MyNode, node);
+    return my->value % 2 != 0;
+}
+
+static void *replace_thread_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int i = 0; i < targ->count; i++) {
+        int value = targ->start_value + i;
+        struct AANode *old = aatree_search(targ->tree, value);
+        MyNode *my = make_node(value);
+        if (old && aatree_replace(targ->tree, old, &my->node))
+            my_node_free(old, NULL);
+        else
+            free(my);
+    }
+    return NULL;
+}
+
+// concurrent replaces keep every value reachable, remove_if honors predicate
+static void test_replace_concurrent() {
+    struct AATree tree[1];
+    pthread_t threads[NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    int found = 0;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < total; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i * NODES_PER_THREAD;
+        args[i].count = NODES_PER_THREAD;
+        pthread_create(&threads[i], NULL, replace_thread_func, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < total; i++) {
+        if (aatree_search(tree, i) != NULL)
+            found++;
+    }
+
+    ok = ok && !aatree_remove_if(tree, 10, my_node_is_odd, NULL);
+    ok = ok && aatree_remove_if(tree, 11, my_node_is_odd, NULL);
+    ok = ok && aatree_search(tree, 10) != NULL && aatree_search(tree, 11) == NULL;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+
+    printf("test_replace_concurrent: %d/%d nodes found\n", found, total);
+    if (ok && found == total) {
+        printf("test_replace_concurrent: PASSED\n");
+    } else {
+        printf("test_replace_concurrent: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+static void *remove_odd_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int i = 0; i < targ->count; i++)
+        aatree_remove_if(targ->tree, targ->start_value + i, my_node_is_odd, NULL);
+    return NULL;
+}
+
+static void *replace_even_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int i = 0; i < targ->count; i += 2) {
+        int value = targ->start_value + i;
+        struct AANode *old = aatree_search(targ->tree, value);
+        MyNode *my = make_node(value);
+        if (old && aatree_replace(targ->tree, old, &my->node))
+            my_node_free(old, NULL);
+        else
+            free(my);
+    }
+    return NULL;
+}
+
+// removes that need no rebalancing run under shared lock next to replaces
+static void test_remove_shared() {
+    struct AATree tree[1];
+    pthread_t threads[2 * NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    uint64_t stats[AA_STAT_COUNT];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    int found = 0;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < total; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i * NODES_PER_THREAD;
+        args[i].count = NODES_PER_THREAD;
+        pthread_create(&threads[2 * i], NULL, remove_odd_func, &args[i]);
+        pthread_create(&threads[2 * i + 1], NULL, replace_even_func, &args[i]);
+    }
+    for (int i = 0; i < 2 * NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < total; i++) {
+        struct AANode *node = aatree_search(tree, i);
+        if (node != NULL)
+            found++;
+        ok = ok && (node != NULL) == (i % 2 == 0);
+    }
+    aatree_get_stats(tree, stats);
+    ok = ok && aatree_count(tree) == total / 2 && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && stats[AA_STAT_REMOVE_EXCLUSIVE] < (uint64_t)total;
+
+    printf("test_remove_shared: %d/%d left, %llu of %d removes exclusive\n",
+           found, total, (unsigned long long)stats[AA_STAT_REMOVE_EXCLUSIVE], total);
+    if (ok) {
+        printf("test_remove_shared: PASSED\n");
+    } else {
+        printf("test_remove_shared: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+static uintptr_t my_node_dist(uintptr_t value, struct AANode *node)
+{
+    MyNode *my = container_of(node, MyNode, node);
+    int diff = (int)value - my->value;
+    return diff < 0 ? -diff : diff;
+}
+
+static int my_node_value(struct AANode *node)
+{
+    return node ? container_of(node, MyNode, node)->value : -1;
+}
+
+// floor/ceil/nearest around keys 0, 10, 20, ...
+static void test_floor_ceil() {
+    struct AATree tree[1];
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i <= 100; i += 10) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    ok = ok && my_node_value(aatree_floor(tree, 37)) == 30;
+    ok = ok && my_node_value(aatree_ceil(tree, 37)) == 40;
+    ok = ok && my_node_value(aatree_floor(tree, 40)) == 40;
+    ok = ok && my_node_value(aatree_ceil(tree, 101)) == -1;
+    ok = ok && my_node_value(aatree_floor(tree, -1)) == -1;
+    ok = ok && my_node_value(aatree_nearest(tree, 37, my_node_dist)) == 40;
+    ok = ok && my_node_value(aatree_nearest(tree, 33, my_node_dist)) == 30;
+    ok = ok && my_node_value(aatree_nearest(tree, 35, my_node_dist)) == 30;
+    ok = ok && my_node_value(aatree_nearest(tree, 500, my_node_dist)) == 100;
+
+    if (ok) {
+        printf("test_floor_ceil: PASSED\n");
+    } else {
+        printf("test_floor_ceil: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+typedef struct {
+    int count;
+    struct AANode *nodes[16];
+} CollectArg;
+
+static void collect_func(struct AANode *node, void *arg)
+{
+    CollectArg *ca = arg;
+    if (ca->count < 16)
+        ca->nodes[ca->count] = node;
+    ca->count++;
+}
+
+static bool node_is_arg(struct AANode *node, void *arg)
+{
+    return node == arg;
+}
+
+// equal values are kept and walked in insertion order
+static void test_duplicates() {
+    struct AATree tree[1];
+    MyNode *dups[8], *first;
+    CollectArg collected = { 0 };
+    bool ok = true;
+
+    aatree_init_flags(tree, my_node_cmp, my_node_free, AA_TREE_DUPLICATES);
+    for (int i = 0; i < 100; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+    for (int i = 0; i < 8; i++) {
+        dups[i] = make_node(42);
+        aatree_insert(tree, 42, &dups[i]->node);
+    }
+
+    ok = ok && aatree_count_equal(tree, 42) == 9;
+    ok = ok && aatree_count_equal(tree, 43) == 1;
+    ok = ok && aatree_count_equal(tree, 1000) == 0;
+    ok = ok && aatree_walk_equal(tree, 42, collect_func, &collected) == 9;
+    // original node first, then duplicates as they came
+    ok = ok && collected.nodes[1] == &dups[0]->node && collected.nodes[8] == &dups[7]->node;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && aatree_count(tree) == 108;
+
+    // single-node calls act on the first equal node
+    first = make_node(42);
+    ok = ok && aatree_insert_or_get(tree, 42, &first->node) == collected.nodes[0];
+    aatree_remove(tree, 42);
+    ok = ok && aatree_upsert(tree, 42, &first->node) == &dups[0]->node;
+    free(dups[0]);
+    ok = ok && !aatree_remove_if(tree, 42, node_is_arg, &dups[1]->node);
+    ok = ok && aatree_remove_if(tree, 42, node_is_arg, &first->node);
+    collected.count = 0;
+    ok = ok && aatree_walk_equal(tree, 42, collect_func, &collected) == 7;
+    ok = ok && collected.nodes[0] == &dups[1]->node && collected.nodes[6] == &dups[7]->node;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && aatree_count(tree) == 106;
+
+    if (ok) {
+        printf("test_duplicates: PASSED\n");
+    } else {
+        printf("test_duplicates: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+typedef struct I64Node I64Node;
+struct I64Node {
+    struct AANode node;
+    int64_t key;
+};
+
+static void i64_node_free(struct AANode *node, void *arg)
+{
+    free(container_of(node, I64Node, node));
+}
+
+typedef struct {
+    int count;
+    int64_t last;
+    bool sorted;
+} I64CheckArg;
+
+static void i64_check_func(struct AANode *node, void *arg)
+{
+    I64CheckArg *ca = arg;
+    int64_t key = AATREE_NODE_KEY(node, int64_t);
+    if (ca->count > 0 && key <= ca->last)
+        ca->sorted = false;
+    ca->last = key;
+    ca->count++;
+}
+
+// built-in comparators must order keys whose difference overflows
+static void test_int_keys() {
+    static const int64_t keys[] = {
+        INT64_MIN, INT64_MIN + 1, -4000000000LL, INT32_MIN, -1, 0, 1,
+        INT32_MAX, 4000000000LL, INT64_MAX - 1, INT64_MAX,
+    };
+    int nkeys = sizeof(keys) / sizeof(keys[0]);
+    struct AATree tree[1];
+    I64CheckArg ca = { 0, 0, true };
+    bool ok = true;
+
+    aatree_init(tree, aatree_cmp_i64, i64_node_free);
+    for (int i = nkeys - 1; i >= 0; i--) {
+        I64Node *n = malloc(sizeof(*n));
+        n->key = keys[i];
+        aatree_insert(tree, (uintptr_t)keys[i], &n->node);
+    }
+
+    aatree_walk(tree, AA_WALK_IN_ORDER, i64_check_func, &ca);
+    ok = ok && ca.sorted && ca.count == nkeys;
+    for (int i = 0; i < nkeys; i++) {
+        struct AANode *node = aatree_search(tree, (uintptr_t)keys[i]);
+        ok = ok && node && AATREE_NODE_KEY(node, int64_t) == keys[i];
+    }
+    ok = ok && aatree_search(tree, (uintptr_t)(int64_t)2) == NULL;
+    ok = ok && AATREE_NODE_KEY(aatree_floor(tree, (uintptr_t)(int64_t)-2), int64_t) == INT32_MIN;
+    aatree_destroy(tree);
+
+    // MyNode value sits right after the node, so i32 compare fits it too
+    aatree_init(tree, aatree_cmp_i32, my_node_free);
+    for (int i = -50; i < 50; i++) {
+        MyNode *my = make_node(i * 40000000);
+        aatree_insert(tree, i * 40000000, &my->node);
+    }
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && strcmp(my_search(tree, -49 * 40000000), "OK") == 0;
+    ok = ok && strcmp(my_search(tree, 49 * 40000000), "OK") == 0;
+    ok = ok && strcmp(my_search(tree, 7), "OK") != 0;
+    aatree_destroy(tree);
+
+    if (ok) {
+        printf("test_int_keys: PASSED\n");
+    } else {
+        printf("test_int_keys: FAILED\n");
+    }
+}
+
+typedef struct {
+    int count;
+    const struct AAStrKey *last;
+    bool sorted;
+} StrCheckArg;
+
+static void str_node_free(struct AANode *node, void *arg)
+{
+    struct AAStrNode *sn = container_of(node, struct AAStrNode, node);
+    free((void *)sn->key.data);
+    free(sn);
+}
+
+static int str_ref_cmp(const struct AAStrKey *a, const struct AAStrKey *b)
+{
+    size_t len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->data, b->data, len);
+    if (cmp)
+        return cmp;
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+static void str_check_func(struct AANode *node, void *arg)
+{
+    StrCheckArg *ca = arg;
+    struct AAStrNode *sn = container_of(node, struct AAStrNode, node);
+    if (ca->count > 0 && str_ref_cmp(ca->last, &sn->key) >= 0)
+        ca->sorted = false;
+    ca->last = &sn->key;
+    ca->count++;
+}
+
+static void str_insert(struct AATree *tree, const void *data, size_t len)
+{
+    struct AAStrNode *sn = malloc(sizeof(*sn));
+    void *copy = malloc(len + 1);
+    memcpy(copy, data, len);
+    aatree_str_key_init(&sn->key, copy, len);
+    aatree_insert(tree, (uintptr_t)&sn->key, &sn->node);
+}
+
+static bool str_found(struct AATree *tree, const void *data, size_t len)
+{
+    struct AAStrKey key;
+    struct AANode *node;
+    aatree_str_key_init(&key, data, len);
+    node = aatree_search(tree, (uintptr_t)&key);
+    return node && str_ref_cmp(&container_of(node, struct AAStrNode, node)->key, &key) == 0;
+}
+
+// string keys, including ties on the inline prefix and embedded zero bytes
+static void test_str_keys() {
+    static const char *words[] = { "", "a", "ab", "abcdefg", "abcdefgh", "abcdefghi", "b" };
+    struct AATree tree[1];
+    StrCheckArg ca = { 0, NULL, true };
+    char buf[32];
+    bool ok = true;
+    int nwords = sizeof(words) / sizeof(words[0]);
+
+    aatree_init(tree, aatree_cmp_str, str_node_free);
+    for (int i = 0; i < 500; i++) {
+        snprintf(buf, sizeof(buf), "key-%05d", (i * 7919) % 500);
+        str_insert(tree, buf, strlen(buf));
+    }
+    for (int i = 0; i < nwords; i++)
+        str_insert(tree, words[i], strlen(words[i]));
+    str_insert(tree, "ab\0", 3);
+    str_insert(tree, "ab\0\0\0\0\0\0\0", 9);
+
+    aatree_walk(tree, AA_WALK_IN_ORDER, str_check_func, &ca);
+    ok = ok && ca.sorted && ca.count == 500 + nwords + 2;
+    for (int i = 0; i < 500; i++) {
+        snprintf(buf, sizeof(buf), "key-%05d", i);
+        ok = ok && str_found(tree, buf, strlen(buf));
+    }
+    for (int i = 0; i < nwords; i++)
+        ok = ok && str_found(tree, words[i], strlen(words[i]));
+    ok = ok && str_found(tree, "ab\0", 3) && str_found(tree, "ab\0\0\0\0\0\0\0", 9);
+    ok = ok && !str_found(tree, "ab\0\0", 4);
+    ok = ok && !str_found(tree, "key-00500", 9);
+    ok = ok && !str_found(tree, "abcdefghij", 10);
+
+    if (ok) {
+        printf("test_str_keys: PASSED\n");
+    } else {
+        printf("test_str_keys: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+static void *arena_insert_thread_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int i = 0; i < targ->count; i++) {
+        MyNode *my = aatree_arena_alloc(targ->tree);
+        memset(my, 0, sizeof(*my));
+        my->value = targ->start_value + i;
+        aatree_insert(targ->tree, my->value, &my->node);
+    }
+    return NULL;
+}
+
+// threads allocate from NUMA arena shards, all nodes end up in tree
+static void test_arena_numa() {
+    struct AATree tree[1];
+    pthread_t threads[NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    int total = NUM_THREADS * NODES_PER_THREAD * 10;
+    bool ok;
+
+    aatree_init(tree, my_node_cmp, NULL);
+    ok = aatree_arena_init_numa(tree, sizeof(MyNode));
+    for (int i = 0; ok && i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i * NODES_PER_THREAD * 10;
+        args[i].count = NODES_PER_THREAD * 10;
+        pthread_create(&threads[i], NULL, arena_insert_thread_func, &args[i]);
+    }
+    for (int i = 0; ok && i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    ok = ok && aatree_count(tree) == total;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+    for (int i = 0; ok && i < total; i++)
+        ok = aatree_search(tree, i) != NULL;
+    aatree_destroy(tree);
+
+    if (ok) {
+        printf("test_arena_numa: PASSED\n");
+    } else {
+        printf("test_arena_numa: FAILED\n");
+    }
+}
+
+typedef struct {
+    struct AATree *tree;
+    int rounds;
+    int misses;
+} ThreadReadArg;
+
+static void *read_thread_func(void *arg)
+{
+    ThreadReadArg *targ = (ThreadReadArg *)arg;
+    for (int r = 0; r < targ->rounds; r++) {
+        for (int i = 0; i < NODES_PER_THREAD; i++) {
+            if (aatree_search(targ->tree, i) == NULL)
+                targ->misses++;
+        }
+    }
+    return NULL;
+}
+
+// readers keep finding nodes while writers go in and out, under every lock policy
+static bool run_lock_workload(int flags, int *found_p, int *misses_p) {
+    struct AATree tree[1];
+    pthread_t insert_threads[NUM_THREADS];
+    pthread_t read_threads[NUM_THREADS];
+    ThreadInsertArg insert_args[NUM_THREADS];
+    ThreadReadArg read_args[NUM_THREADS];
+    int expected_total = NODES_PER_THREAD + NUM_THREADS * NODES_PER_THREAD;
+    bool ok;
+
+    aatree_init_flags(tree, my_node_cmp, my_node_free, flags);
+    for (int i = 0; i < NODES_PER_THREAD; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        read_args[i].tree = tree;
+        read_args[i].rounds = 20;
+        read_args[i].misses = 0;
+        pthread_create(&read_threads[i], NULL, read_thread_func, &read_args[i]);
+        insert_args[i].tree = tree;
+        insert_args[i].start_value = NODES_PER_THREAD + i * NODES_PER_THREAD;
+        insert_args[i].count = NODES_PER_THREAD;
+        pthread_create(&insert_threads[i], NULL, insert_thread_func, &insert_args[i]);
+    }
+    *misses_p = 0;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(insert_threads[i], NULL);
+        pthread_join(read_threads[i], NULL);
+        *misses_p += read_args[i].misses;
+    }
+
+    *found_p = 0;
+    for (int i = 0; i < expected_total; i++) {
+        if (aatree_search(tree, i) != NULL)
+            (*found_p)++;
+    }
+    ok = *found_p == expected_total && *misses_p == 0 && strcmp(check(tree, 0), "OK") == 0;
+
+    aatree_destroy(tree);
+    return ok;
+}
+
+struct NestedReadArg {
+    struct AATree *tree;
+    pthread_t writer;
+    int visited;
+    int found;
+};
+
+static void *nested_writer_func(void *arg)
+{
+    struct AATree *tree = arg;
+    MyNode *my = make_node(1000);
+
+    aatree_insert(tree, 1000, &my->node);
+    return NULL;
+}
+
+// searches from inside the walk, after a writer started waiting for it
+static enum AATreeWalkResult nested_read_visitor(struct AANode *node, void *arg)
+{
+    struct NestedReadArg *na = arg;
+
+    if (na->visited++ == 0) {
+        pthread_create(&na->writer, NULL, nested_writer_func, na->tree);
+        usleep(20000);
+    }
+    if (aatree_search(na->tree, my_node_value(node)) == node)
+        na->found++;
+    return na->visited < 10 ? AA_WALK_CONTINUE : AA_WALK_STOP;
+}
+
+// nested read lock under bias must not wait behind a writer
+static bool run_nested_read(void) {
+    struct AATree tree[1];
+    struct NestedReadArg na = { .tree = tree };
+    bool ok;
+
+    aatree_init_flags(tree, my_node_cmp, my_node_free, AA_TREE_LOCK_BRAVO);
+    for (int i = 0; i < 100; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+    aatree_walk_from(tree, 50, nested_read_visitor, &na);
+    pthread_join(na.writer, NULL);
+
+    ok = na.found == 10 && aatree_search(tree, 1000) != NULL;
+    aatree_destroy(tree);
+    return ok;
+}
+
+static void test_lock_policies() {
+    static const struct { const char *name; int flags; } policies[] = {
+        { "default", 0 },
+        { "bravo", AA_TREE_LOCK_BRAVO },
+        { "writer-pref", AA_TREE_LOCK_WRITER_PREF },
+        { "phase-fair", AA_TREE_LOCK_PHASE_FAIR },
+        { "task-fair", AA_TREE_LOCK_TASK_FAIR },
+        { "bravo+phase-fair", AA_TREE_LOCK_BRAVO | AA_TREE_LOCK_PHASE_FAIR },
+    };
+    int found, misses;
+    bool ok = true;
+
+    for (int i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++) {
+        bool res = run_lock_workload(policies[i].flags, &found, &misses);
+        printf("test_lock_policies: %s: %d nodes found, %d misses%s\n",
+               policies[i].name, found, misses, res ? "" : " - FAILED");
+        ok = ok && res;
+    }
+    if (!run_nested_read()) {
+        printf("test_lock_policies: bravo nested read - FAILED\n");
+        ok = false;
+    }
+
+    if (ok) {
+        printf("test_lock_policies: PASSED\n");
+    } else {
+        printf("test_lock_policies: FAILED\n");
+    }
+}
+
+static void *replace_storm_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int r = 0; r < 2000; r++)
+        replace_thread_func(targ);
+    return NULL;
+}
+
+// threads replacing neighbour nodes wait for each other and get counted
+static void test_contention_stats() {
+    struct AATree tree[1];
+    pthread_t threads[NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    uint64_t stats[AA_STAT_COUNT];
+    int found = 0;
+    bool ok;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < 8; i++) {
+        MyNode *my = make_node(i);
+        aatree_insert(tree, i, &my->node);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i * 8 / NUM_THREADS;
+        args[i].count = 8 / NUM_THREADS;
+        pthread_create(&threads[i], NULL, replace_storm_func, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        if (aatree_search(tree, i) != NULL)
+            found++;
+    }
+    aatree_get_stats(tree, stats);
+    ok = found == 8 && aatree_count(tree) == 8 && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && stats[AA_STAT_PARKS] <= stats[AA_STAT_ACQUIRE_FAILS];
+    ok = ok && (stats[AA_STAT_ACQUIRE_FAILS] == 0 || stats[AA_STAT_WAIT_NS] > 0);
+    /* thread helps only after failing to acquire */
+    ok = ok && stats[AA_STAT_HELPS] <= stats[AA_STAT_ACQUIRE_FAILS];
+
+    printf("test_contention_stats: %llu acquire fails, %llu parks, %llu helps, %llu us waited\n",
+           (unsigned long long)stats[AA_STAT_ACQUIRE_FAILS],
+           (unsigned long long)stats[AA_STAT_PARKS],
+           (unsigned long long)stats[AA_STAT_HELPS],
+           (unsigned long long)stats[AA_STAT_WAIT_NS] / 1000);
+    if (ok) {
+        printf("test_contention_stats: PASSED\n");
+    } else {
+        printf("test_contention_stats: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+static void *insert_stride_func(void *arg)
+{
+    ThreadInsertArg *targ = (ThreadInsertArg *)arg;
+    for (int i = 0; i < targ->count; i++) {
+        int value = targ->start_value + i * NUM_THREADS;
+        MyNode *my = make_node(value);
+        aatree_insert(targ->tree, value, &my->node);
+    }
+    return NULL;
+}
+
+// inserts that need no rotation go in under shared lock, tree stays valid
+static void test_insert_shared() {
+    struct AATree tree[1];
+    pthread_t threads[NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    uint64_t stats[AA_STAT_COUNT];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    int found = 0;
+    bool ok;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+
+    // threads interleave, so they keep attaching next to each other
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i;
+        args[i].count = NODES_PER_THREAD;
+        pthread_create(&threads[i], NULL, insert_stride_func, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < total; i++) {
+        if (aatree_search(tree, i) != NULL)
+            found++;
+    }
+    aatree_get_stats(tree, stats);
+    ok = found == total && aatree_count(tree) == total && strcmp(check(tree, 0), "OK") == 0;
+    ok = ok && stats[AA_STAT_INSERT_EXCLUSIVE] < (uint64_t)total;
+    ok = ok && stats[AA_STAT_INSERT_FALLBACKS] <= stats[AA_STAT_INSERT_EXCLUSIVE];
+
+    printf("test_insert_shared: %d/%d found, %llu exclusive, %llu fallbacks, %llu conflicts\n",
+           found, total,
+           (unsigned long long)stats[AA_STAT_INSERT_EXCLUSIVE],
+           (unsigned long long)stats[AA_STAT_INSERT_FALLBACKS],
+           (unsigned long long)stats[AA_STAT_INSERT_CONFLICTS]);
+    if (ok) {
+        printf("test_insert_shared: PASSED\n");
+    } else {
+        printf("test_insert_shared: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+typedef struct {
+    struct AATree *tree;
+    atomic_int *stop;
+} ThreadLoopArg;
+
+// holds the read lock for a while on every pass
+static enum AATreeWalkResult hold_read_visitor(struct AANode *node, void *arg)
+{
+    usleep(100);
+    return AA_WALK_STOP;
+}
+
+static void *hold_read_loop_func(void *arg)
+{
+    ThreadLoopArg *targ = (ThreadLoopArg *)arg;
+    while (!atomic_load(targ->stop))
+        aatree_walk_from(targ->tree, 0, hold_read_visitor, NULL);
+    return NULL;
+}
+
+static void adaptive_insert(struct AATree *tree, int *total_p, int end)
+{
+    for (; *total_p < end; (*total_p)++) {
+        MyNode *my = make_node(*total_p);
+        aatree_insert(tree, *total_p, &my->node);
+    }
+}
+
+// adaptive tree stays coarse for one writer, goes fine-grained on contention and back
+static void test_adaptive_mode() {
+    struct AATree tree[1];
+    pthread_t reader, writers[NUM_THREADS];
+    ThreadLoopArg rarg;
+    ThreadInsertArg wargs[NUM_THREADS];
+    atomic_int stop;
+    uint64_t stats[AA_STAT_COUNT], exclusive, switches;
+    int total = 0;
+    bool ok;
+
+    // phase-fair, so the reader does not starve writers
+    aatree_init_flags(tree, my_node_cmp, my_node_free, AA_TREE_ADAPTIVE | AA_TREE_LOCK_PHASE_FAIR);
+
+    // one writer: every insert is done under exclusive lock
+    adaptive_insert(tree, &total, 1000);
+    aatree_get_stats(tree, stats);
+    ok = stats[AA_STAT_INSERT_EXCLUSIVE] == 1000 && stats[AA_STAT_MODE_SWITCHES] == 0;
+
+    // reader sits on the lock, so writers find it busy nearly every time
+    atomic_init(&stop, 0);
+    rarg.tree = tree;
+    rarg.stop = &stop;
+    pthread_create(&reader, NULL, hold_read_loop_func, &rarg);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        wargs[i].tree = tree;
+        wargs[i].start_value = total + i * 300;
+        wargs[i].count = 300;
+        pthread_create(&writers[i], NULL, insert_thread_func, &wargs[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    atomic_store(&stop, 1);
+    pthread_join(reader, NULL);
+    total += NUM_THREADS * 300;
+    aatree_get_stats(tree, stats);
+    ok = ok && stats[AA_STAT_MODE_SWITCHES] == 1;
+
+    // quiet again: back in coarse mode after a window or two
+    adaptive_insert(tree, &total, total + 2000);
+    aatree_get_stats(tree, stats);
+    exclusive = stats[AA_STAT_INSERT_EXCLUSIVE];
+    switches = stats[AA_STAT_MODE_SWITCHES];
+    adaptive_insert(tree, &total, total + 400);
+    aatree_get_stats(tree, stats);
+    ok = ok && switches >= 2 && stats[AA_STAT_MODE_SWITCHES] == switches;
+    ok = ok && stats[AA_STAT_INSERT_EXCLUSIVE] - exclusive == 400;
+    ok = ok && aatree_count(tree) == total && strcmp(check(tree, 0), "OK") == 0;
+
+    printf("test_adaptive_mode: %llu mode switches, %llu exclusive inserts of %d\n",
+           (unsigned long long)stats[AA_STAT_MODE_SWITCHES],
+           (unsigned long long)stats[AA_STAT_INSERT_EXCLUSIVE], total);
+    if (ok) {
+        printf("test_adaptive_mode: PASSED\n");
+    } else {
+        printf("test_adaptive_mode: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+#define DELEG_SHARDS 4
+
+// key ranges of equal size
+static int deleg_shard_func(uintptr_t value, void *arg)
+{
+    int total = *(int *)arg;
+    return (int)value * DELEG_SHARDS / total;
+}
+
+typedef struct {
+    struct AADeleg *deleg;
+    int start_value;
+    int count;
+    int errors;
+} ThreadDelegArg;
+
+static void *deleg_client_func(void *arg)
+{
+    ThreadDelegArg *targ = (ThreadDelegArg *)arg;
+    struct AADelegClient *client = aadeleg_client(targ->deleg);
+    int end = targ->start_value + targ->count;
+
+    for (int value = targ->start_value; value < end; value++) {
+        MyNode *my = make_node(value);
+        if (aadeleg_insert(client, value, &my->node) != &my->node)
+            targ->errors++;
+    }
+    // odd ones go again
+    for (int value = targ->start_value; value < end; value++) {
+        if (value % 2 && !aadeleg_remove(client, value))
+            targ->errors++;
+    }
+    if (aadeleg_remove(client, targ->start_value + 1))
+        targ->errors++;
+    aadeleg_client_release(client);
+    return NULL;
+}
+
+// clients go through shard servers, batch search sees the result
+static double cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void test_delegation() {
+    struct AADeleg *deleg;
+    struct AADelegClient *client;
+    pthread_t threads[NUM_THREADS];
+    ThreadDelegArg args[NUM_THREADS];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    uintptr_t values[NUM_THREADS * NODES_PER_THREAD];
+    struct AANode *results[NUM_THREADS * NODES_PER_THREAD];
+    MyNode *dup;
+    int errors = 0, found = 0, count = 0;
+    double idle_ms;
+    bool ok = true;
+
+    deleg = aadeleg_create(DELEG_SHARDS, deleg_shard_func, &total, my_node_cmp, my_node_free, 0);
+    if (!deleg) {
+        printf("test_delegation: FAILED\n");
+        return;
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].deleg = deleg;
+        args[i].start_value = i * NODES_PER_THREAD;
+        args[i].count = NODES_PER_THREAD;
+        args[i].errors = 0;
+        pthread_create(&threads[i], NULL, deleg_client_func, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+
+    // released handle is reused
+    client = aadeleg_client(deleg);
+    for (int i = 0; i < total; i++)
+        values[i] = i;
+    aadeleg_search_batch(client, values, total, results);
+    for (int i = 0; i < total; i++) {
+        if (results[i] != NULL)
+            found++;
+        if ((results[i] != NULL) != (i % 2 == 0))
+            ok = false;
+        else if (results[i] && container_of(results[i], MyNode, node)->value != i)
+            ok = false;
+    }
+    dup = make_node(0);
+    if (aadeleg_insert(client, 0, &dup->node) != results[0])
+        ok = false;
+    free(dup);
+
+    // idle servers go to sleep and wake up for the next call
+    usleep(50000);
+    idle_ms = cpu_ms();
+    usleep(100000);
+    idle_ms = cpu_ms() - idle_ms;
+    if (idle_ms > 20 || aadeleg_search(client, 2) != results[2])
+        ok = false;
+    aadeleg_client_release(client);
+
+    for (int s = 0; s < DELEG_SHARDS; s++) {
+        struct AATree *tree = aadeleg_tree(deleg, s);
+        count += aatree_count(tree);
+        if (strcmp(check(tree, 0), "OK") != 0)
+            ok = false;
+    }
+    ok = ok && errors == 0 && found == total / 2 && count == total / 2;
+
+    printf("test_delegation: %d shards, %d/%d found, %d errors, %.1f ms cpu in 100 ms idle\n",
+           DELEG_SHARDS, found, total / 2, errors, idle_ms);
+    if (ok) {
+        printf("test_delegation: PASSED\n");
+    } else {
+        printf("test_delegation: FAILED\n");
+    }
+
+    aadeleg_destroy(deleg);
+}
+
+#define ASYNC_DEPTH 64
+
+// submit as many as fit, poll in between, never blocks
+static int async_run(struct AAAsync *async, struct AAAsyncOp *ops, int count)
+{
+    struct AAAsyncOp *pending[ASYNC_DEPTH], *done[ASYNC_DEPTH];
+    int submitted = 0, completed = 0, n;
+
+    while (completed < count) {
+        n = 0;
+        while (submitted + n < count && n < ASYNC_DEPTH) {
+            pending[n] = &ops[submitted + n];
+            n++;
+        }
+        submitted += aaasync_submit(async, pending, n);
+        completed += aaasync_poll(async, done, ASYNC_DEPTH);
+    }
+    return completed;
+}
+
+// batches go through submission queue, results come back through completion queue
+static void test_async() {
+    struct AATree tree[1];
+    struct AAAsync *async;
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    struct AAAsyncOp ops[NUM_THREADS * NODES_PER_THREAD];
+    MyNode *nodes[NUM_THREADS * NODES_PER_THREAD];
+    int found = 0, removed = 0;
+    bool ok = true;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    async = aaasync_create(tree, 2, ASYNC_DEPTH);
+    if (!async) {
+        printf("test_async: FAILED\n");
+        aatree_destroy(tree);
+        return;
+    }
+
+    for (int i = 0; i < total; i++) {
+        nodes[i] = make_node(i);
+        ops[i] = (struct AAAsyncOp){ .type = AA_ASYNC_INSERT, .value = i, .node = &nodes[i]->node };
+    }
+    async_run(async, ops, total);
+    for (int i = 0; i < total; i++) {
+        if (ops[i].result != &nodes[i]->node)
+            ok = false;
+    }
+
+    // odd ones go, searches of the rest run batched
+    for (int i = 0; i < total; i++) {
+        ops[i] = (struct AAAsyncOp){ .type = (i % 2) ? AA_ASYNC_REMOVE : AA_ASYNC_SEARCH, .value = i };
+    }
+    async_run(async, ops, total);
+    for (int i = 0; i < total; i++) {
+        if (i % 2) {
+            removed += ops[i].removed;
+        } else if (ops[i].result == &nodes[i]->node) {
+            found++;
+        }
+    }
+
+    aaasync_destroy(async);
+    ok = ok && found == total / 2 && removed == total / 2;
+    ok = ok && aatree_count(tree) == total / 2 && strcmp(check(tree, 0), "OK") == 0;
+
+    printf("test_async: %d found, %d removed of %d\n", found, removed, total);
+    if (ok) {
+        printf("test_async: PASSED\n");
+    } else {
+        printf("test_async: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+// per-thread count shares add up, approximate count stays close
+static void test_count_shards() {
+    struct AATree tree[1];
+    pthread_t threads[NUM_THREADS];
+    ThreadInsertArg args[NUM_THREADS];
+    int total = NUM_THREADS * NODES_PER_THREAD;
+    int exact, approx, removed;
+    bool ok;
+
+    aatree_init(tree, my_node_cmp, my_node_free);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].tree = tree;
+        args[i].start_value = i * NODES_PER_THREAD;
+        args[i].count = NODES_PER_THREAD;
+        pthread_create(&threads[i], NULL, insert_thread_func, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    exact = aatree_count(tree);
+    approx = aatree_count_approx(tree);
+    ok = exact == total && approx <= total && total - approx < 64 * AATREE_COUNT_SHARDS;
+
+    removed = aatree_remove_range(tree, 0, total / 2 - 1);
+    ok = ok && removed == total / 2 && aatree_count(tree) == total - removed;
+
+    printf("test_count_shards: count %d, approximate %d, after removal %d\n",
+           exact, approx, aatree_count(tree));
+    if (ok) {
+        printf("test_count_shards: PASSED\n");
+    } else {
+        printf("test_count_shards: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+// one-thread tree takes no locks and node states, behaves the same
+static void test_no_lock() {
+    struct AATree tree[1];
+    uint64_t stats[AA_STAT_COUNT];
+    int total = 1000, found = 0;
+    bool ok;
+
+    aatree_init_flags(tree, my_node_cmp, my_node_free, AA_TREE_NO_LOCK);
+    for (int i = 0; i < total; i++) {
+        int value = (i * 7) % total;
+        MyNode *my = make_node(value);
+        aatree_insert(tree, value, &my->node);
+    }
+    for (int i = 1; i < total; i += 2) {
+        aatree_remove(tree, i);
+    }
+    // no background thread, released right away
+    aatree_remove_range_deferred(tree, 0, 99);
+
+    for (int i = 0; i < total; i++) {
+        if (aatree_search(tree, i) != NULL)
+            found++;
+    }
+    aatree_get_stats(tree, stats);
+    ok = found == 450 && aatree_count(tree) == 450 && aatree_count_approx(tree) == 450;
+    ok = ok && stats[AA_STAT_INSERT_EXCLUSIVE] == (uint64_t)total;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+
+    printf("test_no_lock: %d found, count %d\n", found, aatree_count(tree));
+    if (ok) {
+        printf("test_no_lock: PASSED\n");
+    } else {
+        printf("test_no_lock: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
+// fixed tree hands out at most capacity nodes and reuses removed ones
+static void test_fixed_capacity() {
+    struct AATree tree[1];
+    int capacity = 64, got = 0, reused = 0;
+    uint64_t stats[AA_STAT_COUNT];
+    MyNode *my;
+    bool ok;
+
+    if (!aatree_init_fixed(tree, my_node_cmp, NULL, 0, sizeof(MyNode), capacity)) {
+        printf("test_fixed_capacity: FAILED\n");
+        return;
+    }
+    while ((my = aatree_arena_alloc(tree)) != NULL) {
+        my->value = got;
+        aatree_insert(tree, got, &my->node);
+        got++;
+    }
+    ok = got == capacity && aatree_count(tree) == capacity;
+
+    // removed nodes, single and by range, come back
+    for (int i = 0; i < 10; i++) {
+        aatree_remove(tree, i);
+    }
+    aatree_remove_range(tree, 20, 29);
+    while ((my = aatree_arena_alloc(tree)) != NULL) {
+        my->value = capacity + reused;
+        aatree_insert(tree, my->value, &my->node);
+        reused++;
+    }
+
+    aatree_get_stats(tree, stats);
+    ok = ok && reused == 20 && aatree_count(tree) == capacity;
+    ok = ok && stats[AA_STAT_INSERT_EXCLUSIVE] == (uint64_t)(capacity + reused);
+
+    // rejected duplicates and upserted-over nodes come back when freed
+    aatree_remove(tree, 40);
+    for (int i = 0; ok && i < 3 * capacity; i++) {
+        my = aatree_arena_alloc(tree);
+        if (!my) {
+            ok = false;
+            break;
+        }
+        my->value = 41;
+        if (aatree_insert_or_get(tree, 41, &my->node) != &my->node) {
+            aatree_arena_free(tree, my);
+        }
+        my = aatree_arena_alloc(tree);
+        if (!my) {
+            ok = false;
+            break;
+        }
+        my->value = 41;
+        aatree_arena_free(tree, aatree_upsert(tree, 41, &my->node));
+    }
+    ok = ok && aatree_count(tree) == capacity - 1;
+    ok = ok && aatree_arena_alloc(tree) != NULL && aatree_arena_alloc(tree) == NULL;
+    ok = ok && aatree_search(tree, 5) == NULL && aatree_search(tree, capacity + 5) != NULL;
+    ok = ok && strcmp(check(tree, 0), "OK") == 0;
+
+    printf("test_fixed_capacity: %d allocated, %d reused\n", got, reused);
+    if (ok) {
+        printf("test_fixed_capacity: PASSED\n");
+    } else {
+        printf("test_fixed_capacity: FAILED\n");
+    }
+
+    aatree_destroy(tree);
+}
+
 int main(void) {
     struct AATree tree[1];
     int i;
@@ -332,6 +1819,49 @@ int main(void) {
     test_insert_concurrent_rebalance();
     printf("\n");
     test_read_concurrent_insert();
+    printf("\n");
+    test_walk_order();
+    printf("\n");
+    test_parallel_walk();
+    printf("\n");
+    test_walk_early_exit();
+    printf("\n");
+    test_destroy_parallel();
+    printf("\n");
+    test_remove_range();
+    printf("\n");
+    test_upsert();
+    printf("\n");
+    test_replace_concurrent();
+    test_remove_shared();
+    printf("\n");
+    test_floor_ceil();
+    printf("\n");
+    test_duplicates();
+    printf("\n");
+    test_int_keys();
+    printf("\n");
+    test_str_keys();
+    printf("\n");
+    test_arena_numa();
+    printf("\n");
+    test_lock_policies();
+    printf("\n");
+    test_contention_stats();
+    printf("\n");
+    test_insert_shared();
+    printf("\n");
+    test_adaptive_mode();
+    printf("\n");
+    test_delegation();
+    printf("\n");
+    test_async();
+    printf("\n");
+    test_count_shards();
+    printf("\n");
+    test_no_lock();
+    printf("\n");
+    test_fixed_capacity();
     
     return 0;
 }